@@ -0,0 +1,676 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elk.h"
+#ifdef __linux__
+#include "loop.h"
+#endif
+
+/*
+    make bench运行，每一项输出每次操作的平均时间。
+    用来和改动之前的版本、或者旁边的参照实现比较，数字只在同一台机器上有意义。
+*/
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+//bytes不为0的时候再输出吞吐量
+static void report(const char *name, double secs, long ops, double bytes)
+{
+    printf("%-36s %12.1f ns/op", name, secs * 1e9 / (double)ops);
+    if (bytes > 0) {
+        printf(" %10.1f MB/s", bytes / secs / 1e6);
+    }
+    printf("\n");
+}
+
+//数字转字符串：js_json_stringify一个全是小数的数组，和%.17g比较
+static void bench_numfmt(void)
+{
+    enum { N = 1000, ROUNDS = 200 };
+    static char mem[64 * 1024];
+    static char out[32 * N];
+    static jsval_t vals[N];
+    char tmp[32];
+    struct js *js = js_create(mem, sizeof(mem));
+    jsval_t arr = js_mkarr(js);
+    srand(1);
+    for (int i = 0; i < N; i++) {
+        //一半是0.1+0.2这种需要17位的，一半是短的
+        double d = (i & 1) ? rand() / (double)RAND_MAX * 1000 : (rand() % 100000) / 100.0;
+        vals[i] = js_mknum(d);
+    }
+    js_arr_push(js, arr, vals, N);
+    double t = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        js_json_stringify(js, arr, out, sizeof(out));
+    }
+    report("numfmt fmtnum (stringify)", now() - t, (long)N * ROUNDS, 0);
+    t = now();
+    size_t sink = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < N; i++) {
+            sink += (size_t)snprintf(tmp, sizeof(tmp), "%.17g", js_getnum(vals[i]));
+        }
+    }
+    report("numfmt snprintf %.17g", now() - t, (long)N * ROUNDS, 0);
+    if (sink == 0) {
+        printf("?\n");
+    }
+}
+
+/*
+    全是数字字面量的脚本：js_eval一个很长的加法表达式，
+    和用strtod把同样的字面量一个一个解析出来比较。
+*/
+static void bench_numparse(void)
+{
+    enum { N = 2000, ROUNDS = 200 };
+    static char mem[64 * 1024];
+    static char code[N * 24];
+    size_t len = 0;
+    srand(2);
+    for (int i = 0; i < N; i++) {
+        //整数、短小数、长小数、指数形式各占一部分
+        switch (i & 3) {
+            case 0: len += (size_t)snprintf(&code[len], sizeof(code) - len, "%d+", rand() % 100000); break;
+            case 1: len += (size_t)snprintf(&code[len], sizeof(code) - len, "%.2f+", rand() / 1000.0); break;
+            case 2: len += (size_t)snprintf(&code[len], sizeof(code) - len, "%.17g+", rand() / (double)RAND_MAX); break;
+            default: len += (size_t)snprintf(&code[len], sizeof(code) - len, "%de-%d+", rand() % 1000, i % 30); break;
+        }
+    }
+    code[len++] = '0';
+    struct js *js = js_create(mem, sizeof(mem));
+    double t = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        js_eval(js, code, len);
+    }
+    report("numparse: js_eval literals", now() - t, (long)N * ROUNDS, (double)len * ROUNDS);
+    double sink = 0;
+    t = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (char *p = code, *end; p < code + len; p = end + 1) {
+            sink += strtod(p, &end);
+        }
+    }
+    report("numparse: strtod literals", now() - t, (long)N * ROUNDS, (double)len * ROUNDS);
+    if (sink == 0) {
+        printf("?\n");
+    }
+}
+
+/*
+    分配速度：每次调用的scope、参数和局部变量都从free list分配（调用结束就还回去），
+    和在arena顶上连续分配同样大小的字符串比较。
+*/
+static void bench_alloc(void)
+{
+    enum { N = 1000000 };
+    static char mem[64 * 1024];
+    static const char lib[] = "let f = function(a, b) { let t = a; return t; };";
+    size_t total, brk, freeb, reused0, reused1;
+    struct js *js = js_create(mem, sizeof(mem));
+    js_eval(js, lib, sizeof(lib) - 1);
+    jsval_t f = js_get(js, js_glob(js), "f"), args[2] = {js_mknum(1), js_mknum(2)};
+    js_call(js, f, args, 2);
+    js_stats(js, &total, &brk, &freeb, &reused0);
+    double t = now();
+    for (int i = 0; i < N; i++) {
+        js_call(js, f, args, 2);
+    }
+    t = now() - t;
+    js_stats(js, &total, &brk, &freeb, &reused1);
+    report("alloc js_call, scope from free list", t, N, 0);
+    printf("    %.1f blocks reused per call, brk %u\n", (double)(reused1 - reused0) / N, (unsigned)brk);
+    js_mark(js);
+    long n = 0;
+    t = now();
+    for (int r = 0; r < N / 1000; r++) {
+        for (int i = 0; i < 1000; i++) {
+            n += !js_iserr(js_mkstr(js, "abcd", 4));
+        }
+        js_reset(js);
+    }
+    report("alloc bump js_mkstr (+reset)", now() - t, n, 0);
+}
+
+/*
+    内存占用：同样形状的JSON记录解析很多条，平均每条用掉多少arena。
+    前8个成员放在slot里面（每个8字节，shape共用），再多的成员挂在prop链表上；
+    全部用prop链表的话对象8字节、每个成员16字节的T_PROP，换算出来放在后面对比。
+*/
+static void bench_footprint(void)
+{
+    enum { N = 10000, INLINE = 8 };
+    static const char *recs[] = {
+        "{\"id\":12345,\"score\":0.5,\"ok\":true,\"tag\":null}",
+        "{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,\"h\":8,\"i\":9,\"j\":10,\"k\":11,\"l\":12}",
+    };
+    static const int nkeys[] = {4, 12};
+    size_t len = 4 * 1024 * 1024;
+    char *mem = malloc(len);
+    size_t total, brk0, brk1, freeb, reused;
+    for (int r = 0; r < 2; r++) {
+        struct js *js = js_create(mem, len);
+        size_t n = strlen(recs[r]);
+        js_stats(js, &total, &brk0, &freeb, &reused);
+        for (int i = 0; i < N; i++) {
+            js_json_parse(js, recs[r], n);
+        }
+        js_stats(js, &total, &brk1, &freeb, &reused);
+        int inl = nkeys[r] < INLINE ? nkeys[r] : INLINE;
+        double per = (double)(brk1 - brk0) / N;
+        //slot对象比prop链表多一个8字节的slot blob头，每个inline成员少8字节
+        printf("footprint %2d keys: %6.1f bytes/rec, prop-chain layout %6.1f\n", nkeys[r], per,
+            per + 8.0 * inl - 8);
+    }
+    free(mem);
+}
+
+/*
+    纯数字的小函数，宿主用js_call调用：JIT关闭（每次都建scope解释执行）、
+    JIT打开（热了以后直接执行机器码），和同样的C函数比较。
+*/
+static double jitref(double x, double y)
+{
+    double t = x * 0.5 + y;
+    return t > 0 ? t * t - x / (y + 1) : -t;
+}
+
+static void bench_jit(void)
+{
+    enum { N = 1000000 };
+    static char mem[64 * 1024];
+    static const char lib[] =
+        "let f = function(x, y) { let t = x * 0.5 + y; return t > 0 ? t * t - x / (y + 1) : -t; };";
+    struct js *js = js_create(mem, sizeof(mem));
+    js_eval(js, lib, sizeof(lib) - 1);
+    jsval_t f = js_get(js, js_glob(js), "f");
+    jsval_t args[2];
+    for (int on = 0; on < 2; on++) {
+        if (on && !js_jit(js, true)) {
+            printf("jit not available\n");
+            return;
+        }
+        double sum = 0, t = now();
+        for (int i = 0; i < N; i++) {
+            args[0] = js_mknum(i & 1023);
+            args[1] = js_mknum(i & 7);
+            sum += js_getnum(js_call(js, f, args, 2));
+        }
+        report(on ? "jit js_call (compiled)" : "jit js_call (interpreted)", now() - t, N, 0);
+        if (sum == 0) {
+            printf("?\n");
+        }
+    }
+    js_jit(js, false);
+    double sum = 0, t = now();
+    for (int i = 0; i < N; i++) {
+        sum += jitref(i & 1023, i & 7);
+    }
+    report("jit same function in C", now() - t, N, 0);
+    if (sum == 0) {
+        printf("?\n");
+    }
+}
+
+/*
+    JSON记录进arena：js_json_parse（解析加建对象）和宿主一个字段一个字段地
+    js_mkobj/js_set。宿主那边假设字段已经解析好了，只算建对象的时间，
+    所以对它是偏宽的。每条记录以后js_reset，arena不会满。
+*/
+static void bench_json(void)
+{
+    enum { N = 200000 };
+    static char mem[64 * 1024];
+    char rec[160], out[256];
+    struct js *js = js_create(mem, sizeof(mem));
+    size_t len = (size_t)snprintf(rec, sizeof(rec),
+        "{\"id\":12345,\"name\":\"user12345\",\"score\":87.5,\"active\":true,"
+        "\"city\":\"Shenzhen\",\"tags\":[\"a\",\"bb\",\"ccc\"]}");
+    double t = now();
+    for (int i = 0; i < N; i++) {
+        js_json_parse(js, rec, len);
+        js_reset(js);
+    }
+    double secs = now() - t;
+    report("json parse", secs, N, (double)len * N);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        jsval_t o = js_mkobj(js), tags = js_mkarr(js);
+        jsval_t v[3] = {js_mkstr(js, "a", 1), js_mkstr(js, "bb", 2), js_mkstr(js, "ccc", 3)};
+        js_set(js, o, "id", js_mknum(12345));
+        js_set(js, o, "name", js_mkstr(js, "user12345", 9));
+        js_set(js, o, "score", js_mknum(87.5));
+        js_set(js, o, "active", js_mknum(1));
+        js_set(js, o, "city", js_mkstr(js, "Shenzhen", 8));
+        js_arr_push(js, tags, v, 3);
+        js_set(js, o, "tags", tags);
+        js_reset(js);
+    }
+    secs = now() - t;
+    report("json manual build", secs, N, (double)len * N);
+    jsval_t v = js_json_parse(js, rec, len);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        js_json_stringify(js, v, out, sizeof(out));
+    }
+    secs = now() - t;
+    report("json stringify", secs, N, (double)len * N);
+}
+
+/*
+    1M个元素的数组：一个一个push填满、随机下标读、从头到尾读一遍。
+    脚本里面没有下标语法，都是宿主通过js_arr_*访问，和C数组的同样操作比较。
+*/
+static void bench_arr(void)
+{
+    enum { N = 1 << 20 };
+    const size_t memsz = 64 << 20;//扩容的时候新旧元素存储同时存在
+    char *mem = malloc(memsz);
+    double *ref = malloc(N * sizeof(double));
+    uint32_t *idx = malloc(N * sizeof(uint32_t));
+    if (mem == NULL || ref == NULL || idx == NULL) {
+        free(mem);
+        free(ref);
+        free(idx);
+        return;
+    }
+    struct js *js = js_create(mem, memsz);
+    jsval_t arr = js_mkarr(js);
+    srand(1);
+    for (int i = 0; i < N; i++) {
+        idx[i] = (uint32_t)rand() % N;
+    }
+    double t = now();
+    for (int i = 0; i < N; i++) {
+        jsval_t v = js_mknum(i);
+        js_arr_push(js, arr, &v, 1);
+    }
+    report("arr 1M: push fill", now() - t, N, 0);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        js_arr_set(js, arr, (size_t)i, js_mknum(N - i));
+    }
+    report("arr 1M: set fill", now() - t, N, 0);
+    for (int i = 0; i < N; i++) {
+        ref[i] = N - i;
+    }
+    double s = 0, sref = 0;
+    t = now();
+    for (int i = 0; i < N; i++) {
+        s += js_getnum(js_arr_get(js, arr, idx[i]));
+    }
+    report("arr 1M: random get", now() - t, N, 0);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        sref += ref[idx[i]];
+    }
+    report("arr 1M: random get (C array)", now() - t, N, 0);
+    t = now();
+    for (size_t i = 0, n = js_arr_len(js, arr); i < n; i++) {
+        s += js_getnum(js_arr_get(js, arr, i));
+    }
+    report("arr 1M: iterate", now() - t, N, 0);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        sref += ref[i];
+    }
+    report("arr 1M: iterate (C array)", now() - t, N, 0);
+    if (s != sref) {
+        printf("arr: wrong sum %g, want %g\n", s, sref);
+    }
+    free(mem);
+    free(ref);
+    free(idx);
+}
+
+/*
+    同一条规则跑很多条记录：js_batch和每条记录都重新执行一遍脚本比较。
+    每次调用的做法是reset、执行库脚本、解析记录、绑定、执行规则。
+*/
+static void bench_batch(void)
+{
+    enum { N = 1000, ROUNDS = 50 };
+    static char mem[64 * 1024];
+    static char recbuf[N][64];
+    static const char *recs[N];
+    static jsval_t out[N];
+    const char *lib = "let k = 3; let f = function(x) { return x * k + 1; };";
+    const char *rule = "f(rec.a) + rec.b";
+    struct js *js = js_create(mem, sizeof(mem));
+    for (int i = 0; i < N; i++) {
+        snprintf(recbuf[i], sizeof(recbuf[i]), "{\"a\":%d,\"b\":%d,\"c\":\"n%d\"}", i, i * 2, i);
+        recs[i] = recbuf[i];
+    }
+    double t = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < N; i++) {
+            js_reset(js);
+            js_eval(js, lib, strlen(lib));
+            js_set(js, js_glob(js), "rec", js_json_parse(js, recs[i], strlen(recs[i])));
+            out[i] = js_eval(js, rule, strlen(rule));
+        }
+    }
+    report("batch: per-call js_eval", now() - t, (long)N * ROUNDS, 0);
+    js_reset(js);
+    js_eval(js, lib, strlen(lib));
+    js_mark(js);
+    t = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        js_batch(js, "rec", rule, strlen(rule), recs, NULL, N, out);
+    }
+    report("batch: js_batch", now() - t, (long)N * ROUNDS, 0);
+    if (js_getnum(out[N - 1]) != (N - 1) * 5 + 1) {
+        printf("batch: wrong result %g\n", js_getnum(out[N - 1]));
+    }
+    //rule每条记录都重新解析一遍：结果一样，但是前面多了一段不会执行的分支，多出来的时间就是解析的开销
+    static char longrule[1024];
+    size_t len = (size_t)snprintf(longrule, sizeof(longrule), "rec.a < 0 ? 0");
+    for (int i = 0; i < 20; i++) {
+        len += (size_t)snprintf(&longrule[len], sizeof(longrule) - len, " + f(rec.b * k + %d)", i);
+    }
+    snprintf(&longrule[len], sizeof(longrule) - len, " : %s", rule);
+    t = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        js_batch(js, "rec", longrule, strlen(longrule), recs, NULL, N, out);
+    }
+    report("batch: js_batch, rule +400 bytes", now() - t, (long)N * ROUNDS, 0);
+    if (js_getnum(out[N - 1]) != (N - 1) * 5 + 1) {
+        printf("batch: wrong result %g\n", js_getnum(out[N - 1]));
+    }
+}
+
+/*
+    冷启动：新建实例以后执行库脚本，和从缓存目录装载比较。
+    库脚本定义一些函数，并且在顶层调几次算出一些常量。
+*/
+static void bench_cache(void)
+{
+    enum { N = 2000 };
+    static char mem[64 * 1024];
+    static char lib[8192];
+    char dir[] = "/tmp/elkbXXXXXX", path[300];
+    size_t len = 0;
+    for (int i = 0; i < 40; i++) {
+        len += (size_t)snprintf(&lib[len], sizeof(lib) - len,
+            "let f%d = function(x, y) { return x * %d + y; }; let c%d = f%d(%d, 1) * 2 + f%d(1, %d);\n",
+            i, i, i, i, i, i, i);
+    }
+    if (mkdtemp(dir) == NULL) {
+        return;
+    }
+    double t = now();
+    for (int i = 0; i < N; i++) {
+        js_eval(js_create(mem, sizeof(mem)), lib, len);
+    }
+    report("cold start: js_eval", now() - t, N, 0);
+    js_eval_cached(js_create(mem, sizeof(mem)), dir, lib, len);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        js_eval_cached(js_create(mem, sizeof(mem)), dir, lib, len);
+    }
+    report("cold start: js_eval_cached hit", now() - t, N, 0);
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+/*
+    每个请求一个实例：以前js_create要memset整个arena，现在只清struct js，
+    pool的release只清用过的部分。三种做法都执行同一段小脚本。
+*/
+static void bench_pool(void)
+{
+    static const size_t sizes[] = {64 << 10, 1 << 20, 16 << 20, 64 << 20};
+    const char *code = "let a = 1 + 2; let s = \"abc\"; a * 2";
+    char name[64];
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        size_t size = sizes[k], plen = size + 4096;
+        long n = (long)((256 << 20) / size);//每种大小大概碰256MB
+        char *buf = malloc(plen);
+        if (buf == NULL) {
+            return;
+        }
+        double t = now();
+        for (long i = 0; i < n; i++) {
+            memset(buf, 0, size);
+            struct js *js = js_create(buf, size);
+            js_eval(js, code, strlen(code));
+        }
+        snprintf(name, sizeof(name), "pool %5zuK: memset+create+eval", size >> 10);
+        report(name, now() - t, n, 0);
+        t = now();
+        for (long i = 0; i < n; i++) {
+            struct js *js = js_create(buf, size);
+            js_eval(js, code, strlen(code));
+        }
+        snprintf(name, sizeof(name), "pool %5zuK: create+eval", size >> 10);
+        report(name, now() - t, n, 0);
+        struct jspool *pool = js_pool_create(buf, plen, size, NULL);
+        t = now();
+        for (long i = 0; i < n; i++) {
+            struct js *js = js_pool_acquire(pool);
+            js_eval(js, code, strlen(code));
+            js_pool_release(pool, js);
+        }
+        snprintf(name, sizeof(name), "pool %5zuK: acquire+eval+release", size >> 10);
+        report(name, now() - t, n, 0);
+        free(buf);
+    }
+}
+
+#ifdef __linux__
+static long nread;
+
+static jsval_t bread(struct js *js, jsval_t *args, int nargs)
+{
+    char b[64];
+    (void)js;
+    if (nargs > 0 && read((int)js_getnum(args[0]), b, sizeof(b)) > 0) {
+        nread++;
+    }
+    return js_mkundef();
+}
+
+/*
+    事件循环：NJS个实例共用一个loop，每个watch一个pipe，回调里面调宿主函数把数据读掉。
+    延迟是写一个pipe到回调执行完；吞吐是所有pipe都写上以后一轮处理完。
+*/
+static void bench_loop(void)
+{
+    enum { NJS = 256, MEMSZ = 4096, N = 20000 };
+    static char mem[NJS][MEMSZ];
+    static int fds[NJS][2];
+    const char *code = "watch(rfd, function(fd){ bread(fd); }); 0";
+    struct jsloop *loop = js_loop_create();
+    if (loop == NULL) {
+        return;
+    }
+    for (int i = 0; i < NJS; i++) {
+        struct js *js = js_create(mem[i], MEMSZ);
+        if (pipe(fds[i]) != 0) {
+            return;
+        }
+        js_loop_add(loop, js);
+        js_set(js, js_glob(js), "bread", js_mkfun(bread));
+        js_set(js, js_glob(js), "rfd", js_mknum(fds[i][0]));
+        js_eval(js, code, strlen(code));
+    }
+    nread = 0;
+    double t = now();
+    for (int i = 0; i < N; i++) {
+        if (write(fds[(i * 7) % NJS][1], "x", 1) != 1) {
+            break;
+        }
+        while (nread <= i) {
+            js_loop_step(loop, -1);
+        }
+    }
+    report("loop: write to callback latency", now() - t, N, 0);
+    nread = 0;
+    t = now();
+    for (int r = 0; r < N / NJS; r++) {
+        for (int i = 0; i < NJS; i++) {
+            if (write(fds[i][1], "x", 1) != 1) {
+                break;
+            }
+        }
+        while (nread < (long)(r + 1) * NJS) {
+            js_loop_step(loop, -1);
+        }
+    }
+    report("loop: dispatch throughput", now() - t, nread, 0);
+    js_loop_destroy(loop);
+    for (int i = 0; i < NJS; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+#endif
+
+static jsval_t bget(struct js *js, jsval_t *args, int nargs)
+{
+    (void)args;
+    (void)nargs;
+    return js_mkpending(js);
+}
+
+/*
+    一个线程同时挂着NJS个脚本，每个脚本做两次“远程调用”。
+    调用的结果在LATENCY_US以后才到，用一个按到期时间排好的环形队列模拟，
+    到期的就js_resume，其他时间都在等，线程不会被某一个脚本卡住。
+*/
+static void bench_suspend(void)
+{
+    enum { NJS = 1000, ROUNDS = 20, MEMSZ = 2048 };
+    const double LATENCY_US = 50;
+    static char mem[NJS][MEMSZ];
+    static struct js *jss[NJS];
+    static double due[NJS];
+    const char *code = "let a = get(1); let b = get(a); a + b";
+    long nresume = 0, ndone = 0;
+    double t = now(), wait = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        int head = 0, live = 0;
+        for (int i = 0; i < NJS; i++) {
+            jss[i] = js_create(mem[i], MEMSZ);
+            js_set(jss[i], js_glob(jss[i]), "get", js_mkfun(bget));
+            js_eval(jss[i], code, strlen(code));
+            due[i] = now() + LATENCY_US * 1e-6;
+            live++;
+        }
+        //队列里面的到期时间是递增的，按顺序处理，没到期就空转等
+        while (live > 0) {
+            int i = head;
+            head = (head + 1) % NJS;
+            if (jss[i] == NULL) {
+                continue;
+            }
+            double w = now();
+            while (now() < due[i]) {
+            }
+            wait += now() - w;
+            js_resume(jss[i], js_mknum(i));
+            nresume++;
+            if (js_suspended(jss[i])) {
+                due[i] = now() + LATENCY_US * 1e-6;
+            } else {
+                jss[i] = NULL;
+                live--;
+                ndone++;
+            }
+        }
+    }
+    double secs = now() - t;
+    report("suspend: script (2 waits)", secs, ndone, 0);
+    report("suspend: cpu per resume", secs - wait, nresume, 0);
+}
+
+/*
+    解释器本身：每次js_eval都是直接在源码上解析加执行。
+    只解析（函数体定义的时候跳过）、算一个表达式、调一个js函数、执行一串赋值语句分开测。
+*/
+static void bench_eval(void)
+{
+    enum { N = 20000 };
+    static char mem[64 * 1024];
+    static char fn[2048], stmts[2048];
+    const char *lib = "let a = 3; let b = 4; let f = function(x, y) { return x * y + a; };";
+    const char *expr = "(a + b) * 3 - a / b";
+    const char *call = "f(a, b)";
+    size_t fnlen = 0, slen = 0;
+    fnlen += (size_t)snprintf(&fn[fnlen], sizeof(fn) - fnlen, "let h = function(x) { ");
+    for (int i = 0; i < 64; i++) {
+        fnlen += (size_t)snprintf(&fn[fnlen], sizeof(fn) - fnlen, "x = x * 2 + %d; ", i);
+    }
+    fnlen += (size_t)snprintf(&fn[fnlen], sizeof(fn) - fnlen, "return x; }; 0");
+    for (int i = 0; i < 64; i++) {
+        slen += (size_t)snprintf(&stmts[slen], sizeof(stmts) - slen, "a = a * 2 + %d - a; ", i);
+    }
+    struct js *js = js_create(mem, sizeof(mem));
+    js_eval(js, lib, strlen(lib));
+    js_mark(js);
+    double t = now();
+    for (int i = 0; i < N; i++) {
+        js_eval(js, fn, fnlen);
+        js_reset(js);
+    }
+    report("eval: parse 1K function def", now() - t, N, (double)fnlen * N);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        js_eval(js, expr, strlen(expr));
+    }
+    report("eval: (a + b) * 3 - a / b", now() - t, N, 0);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        js_eval(js, call, strlen(call));
+    }
+    report("eval: call f(a, b)", now() - t, N, 0);
+    t = now();
+    for (int i = 0; i < N; i++) {
+        js_eval(js, stmts, slen);
+        js_reset(js);
+    }
+    report("eval: 64 assignments", now() - t, N, (double)slen * N);
+    jsval_t v = js_eval(js, call, strlen(call));
+    if (js_getnum(v) != 15) {
+        printf("eval: wrong result %g\n", js_getnum(v));
+    }
+}
+
+int main(void)
+{
+    bench_eval();
+    bench_json();
+    bench_arr();
+    bench_suspend();
+    bench_batch();
+    bench_cache();
+    bench_pool();
+#ifdef __linux__
+    bench_loop();
+#endif
+    bench_numfmt();
+    bench_numparse();
+    bench_alloc();
+    bench_footprint();
+    bench_jit();
+    return 0;
+}
@@ -4,12 +4,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define NUM_X86 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JS_CACHE 1
+#endif
+#if defined(__linux__) && defined(__x86_64__)
+#include <sys/mman.h>
+#define JS_JIT 1
+#endif
 
 #include "elk.h"
 #include "mylog.h"
 
 typedef uint32_t jsoff_t;
 
+//arena的一个位置，退回到这里的时候上面分配的东西全部作废
+struct jsmark {
+    jsoff_t brk;
+    jsoff_t head;//全局scope的prop链表头，let会往上面加
+    jsoff_t xstr;
+    jsoff_t jitused;
+    jsoff_t undo;
+    jsoff_t ubrk;//mark之前的ubrk，去掉这个mark的时候恢复
+    jsval_t scope;
+};
+
 struct js {
     jsoff_t css;//运行时最大的C栈的大小
     jsoff_t lwm;//最少要保留的内存，低于这个值就可能导致问题。
@@ -29,6 +55,11 @@ struct js {
     jsoff_t toff; //token offset，上一个token的偏移位置。
     jsoff_t tlen ;// 上一个token的len
     jsoff_t nogc; //不需要被gc的entity的位置。
+    jsoff_t xstr; //外部字符串链表的头，0表示没有
+    jsoff_t sites; //运算符site表的blob，0表示还没有分配，~0表示分配失败
+    jsoff_t shapes; //shape转换缓存的blob，0表示还没有分配
+    jsoff_t prof; //分配点统计表的blob，0表示没有打开
+    jsoff_t nrun; //js_run嵌套的层数，0表示是宿主直接调用的API在分配
 
     jsval_t tval;// 上一个解析得到的num或者str的值。
     jsval_t scope;// 当前的scope
@@ -38,8 +69,36 @@ struct js {
     jsoff_t brk;//内存的top位置
     jsoff_t gct;// gc threshold， brk超过这个位置，就启动gc。
 
-    jsoff_t maxcss;//允许的最大的C栈大小。
+    jsoff_t maxcss;//允许的最大的C栈大小，0表示不检查。
+#define JS_MAXCSS (1024U * 1024U) //默认的maxcss，每层js函数调用大约2K，够递归几百层
     void *cstk;// c栈pointer，在启动js_eval时的位置。
+
+#define FREE_MAXSIZE 64 //不超过这个大小的entity释放以后按大小放进free list
+    jsoff_t freel[FREE_MAXSIZE / 4 + 1];//下标是entity大小/4，0表示空
+    jsoff_t nreuse;//从free list分配的次数
+
+    uint8_t susp;//挂起状态
+#define S_NONE   0 //没有挂起
+#define S_WAIT   1 //宿主函数返回了pending，等js_resume
+#define S_REPLAY 2 //resume以后重新执行挂起的语句
+    uint8_t ilog;//重新执行时下一个要取的slog下标
+    uint8_t nlog;//当前语句里面已经完成的C调用个数
+    jsoff_t spos;//挂起的语句的开始位置
+    bool seff;//当前语句在挂起之前赋过值或者调用过js函数，重新执行会再做一遍，不能挂起
+#define JS_MAXLOG 8 //一条语句里面挂起之前最多有几次C调用
+    jsval_t slog[JS_MAXLOG];//当前语句里面C调用的返回值，重新执行时按顺序直接返回
+
+    struct jsmark base;//js_reset退回到的位置
+    jsoff_t undo;//undo log的头，0表示没有
+    jsoff_t ubrk;//最近一次mark的brk，改写这下面的内存要先记undo log
+    jsoff_t hwm;//上次js_reset以来brk到过的最高位置
+    jsoff_t argmin;//上次js_reset以来参数区（js->size往下）到过的最低位置
+    void *udata;//宿主自己的数据，js_reset不会清掉
+
+    jsoff_t jit;//JIT表的blob，0表示还没有分配
+    uint8_t *jitmem;//放机器码的可执行内存，NULL表示还没有分配
+    jsoff_t jitused;//jitmem用掉的字节数
+    bool jiton;//js_jit打开了没有
 };
 
 enum {
@@ -153,7 +212,9 @@ enum {
     T_FUNC,
     T_CODEREF,
     T_CFUNC,
-    T_ERR
+    T_ERR,
+    T_ARR,
+    T_VIEW //typed array，元素在host的内存里面
 };
 
 static jsval_t tov(double d)
@@ -178,22 +239,33 @@ static double tod(jsval_t v)
     };
     return u.d;
 }
+
+//计算出来的double都要经过这里，正的NaN会和装箱的值冲突，换成符号位为1的NaN
+static jsval_t mknum(double d)
+{
+    return isnan(d) ? tov(-NAN) : tov(d);
+}
+
+/*
+    tag里面放type+1。tag为0的时候就是+Infinity（0x7ff0000000000000），
+    不能当成装箱的值，否则1/0会变成全局对象。
+*/
 static jsval_t mkval(uint8_t type, uint64_t data)
 {
     return ((jsval_t)0x7ff0U << 48) | \
-        ((jsval_t)(type)<<48) | \
+        ((jsval_t)(type + 1U)<<48) | \
         (data & 0xffffffffffffUL);
 
 }
 static bool is_nan(jsval_t v)
 {
-    return (v>>52)==0x7ffU;
+    return (v>>52)==0x7ffU && ((v>>48U)&15U) != 0;
 }
 
 static uint8_t vtype(jsval_t v)
 {
     if (is_nan(v)) {
-        return (v>>48U)&15U;
+        return (uint8_t)(((v>>48U)&15U) - 1U);
     } else {
         return (uint8_t)T_NUM;
     }
@@ -238,6 +310,13 @@ static bool is_xdigit(int c)
 {
     return is_digit(c) || (c>='a' && c<='f') || (c>='A'&&c<='F');
 }
+static int unhex(int c)
+{
+    if (is_digit(c)) {
+        return c - '0';
+    }
+    return (c | 0x20) - 'a' + 10;
+}
 static bool is_alpha(int c)
 {
     return (c>='a' && c<='z') || (c>='A' && c<='Z');
@@ -294,8 +373,20 @@ static size_t cpy(char *dst, size_t dstlen, const char *src, size_t srclen)
     return i;
 }
 
+/*
+    entity头部的低2bit是类型，T_OBJ/T_PROP/T_STR之外剩下的3给原始数据块用，
+    头部是(字节数<<2)|E_BLOB，数组的元素存储就放在blob里面。
+    js_free释放的块头部是(字节数<<2)|原来的类型|E_DEAD，大小和blob一样算，
+    低2bit留着原来的类型，堆统计按类型分别算死了多少。
+*/
+#define E_BLOB 3U
+#define E_DEAD 0x80000000U
+
 static inline jsoff_t esize(jsoff_t w)
 {
+    if (w & E_DEAD) {
+        return (jsoff_t)(sizeof(jsoff_t) + align32((w & ~E_DEAD)>>2U));
+    }
     switch (w&3U)
     {
     case T_OBJ:
@@ -303,30 +394,69 @@ static inline jsoff_t esize(jsoff_t w)
     case T_PROP:
         return (jsoff_t)(sizeof(jsoff_t) + sizeof(jsoff_t) + sizeof(jsval_t));
     case T_STR:
+    case E_BLOB:
         return (jsoff_t)(sizeof(jsoff_t) + align32(w>>2U));
     default:
         return (jsoff_t)~0U;
     }
 }
 
+static void profalloc(struct js *js, jsoff_t size);
+
 static jsoff_t js_alloc(struct js *js, size_t size)
 {
     jsoff_t ofs = js->brk;
     size = align32(size);
-    if (js->brk + size > js->size) {
+    if (size <= FREE_MAXSIZE && js->freel[size >> 2] != 0) {
+        ofs = js->freel[size >> 2];
+        memcpy(&js->freel[size >> 2], &js->mem[ofs + sizeof(ofs)], sizeof(ofs));
+        js->nreuse++;
+    } else if (js->brk + size > js->size) {
         myloge("oom");
         return ~0U;
+    } else {
+        js->brk += size;
+        if (js->brk > js->hwm) {
+            js->hwm = js->brk;
+        }
+    }
+    if (js->prof != 0) {
+        profalloc(js, (jsoff_t)size);//只统计成功的分配
     }
-    js->brk += size;
     return ofs;
 }
 
+/*
+    把[off, off+size)还回去。在最顶上就直接退回brk，
+    否则改成一个死blob（保证还能按esize遍历），小的放进对应的free list，
+    大的等gc。free list里面blob的第一个字是下一个空闲块的offset。
+    off上面必须是一个entity的头部，类型留在死块的头部里面。
+*/
+static void js_free(struct js *js, jsoff_t off, jsoff_t size)
+{
+    jsoff_t b;
+    if (off < js->ubrk) {
+        return;//mark之前的块rollback以后可能还要用，不能回收
+    }
+    if (off + size == js->brk) {
+        js->brk = off;
+        return;
+    }
+    memcpy(&b, &js->mem[off], sizeof(b));
+    b = ((size - (jsoff_t)sizeof(b)) << 2) | (b & 3U) | E_DEAD;
+    memcpy(&js->mem[off], &b, sizeof(b));
+    if (size >= sizeof(b) * 2 && size <= FREE_MAXSIZE) {
+        memcpy(&js->mem[off + sizeof(b)], &js->freel[size >> 2], sizeof(b));
+        js->freel[size >> 2] = off;
+    }
+}
+
 jsval_t js_mkerr(struct js *js, const char *xx, ...)
 {
     va_list ap;
     size_t n = cpy(js->errmsg, sizeof(js->errmsg), "ERROR: ", 7);
     va_start(ap, xx);
-    vsnprintf(js->errmsg+n, sizeof(js->errmsg), xx, ap);
+    vsnprintf(js->errmsg+n, sizeof(js->errmsg) - n, xx, ap);
     va_end(ap);
     js->errmsg[sizeof(js->errmsg) - 1] = '\0';
     js->pos = js->clen;
@@ -349,7 +479,8 @@ static jsval_t mkentity(struct js* js, jsoff_t b, const char *buf, size_t len)
     if (buf != NULL) {
         //memmove可以处理内存重叠的情况，比memcpy更加安全。
         //当然，你明确知道内部不会重叠的时候，还是优先用memcpy
-        memmove(&js->mem[ofs+sizeof(b)], buf, len);
+        //字符串的len包括结尾的0，buf里面没有这个0
+        memmove(&js->mem[ofs+sizeof(b)], buf, (b&3) == T_STR ? len - 1 : len);
     }
     if ((b&3) == T_STR) {
         js->mem[ofs + sizeof(b) + len - 1] = 0;
@@ -358,7 +489,7 @@ static jsval_t mkentity(struct js* js, jsoff_t b, const char *buf, size_t len)
 
 }
 
-static const char *typestr(uint8_t)
+static const char *typestr(uint8_t t)
 {
     const char *names[] = {
         "object",
@@ -372,6 +503,8 @@ static const char *typestr(uint8_t)
         "coderef",//这个具体指什么？
         "cfunc",
         "err",
+        "array",
+        "typedarray",
         "nan"
     };
     if (t < sizeof(names)/sizeof(names[0])) {
@@ -386,7 +519,7 @@ static const char *typestr(uint8_t)
 */
 static jsval_t mkobj(struct js* js, jsoff_t parent)
 {
-    return mkentity(js, 0 | T_OBJ, &parent, sizeof(parent));
+    return mkentity(js, 0 | T_OBJ, (const char *)&parent, sizeof(parent));
 }
 
 jsval_t js_mkundef(void)
@@ -407,34 +540,429 @@ jsval_t js_mkfalse(void)
 }
 jsval_t js_mknum(double value)
 {
-    return tov(value);
+    return mknum(value);
+}
+
+//不是数字返回NaN
+double js_getnum(jsval_t value)
+{
+    return vtype(value) == T_NUM ? tod(value) : NAN;
+}
+
+bool js_isfunc(jsval_t value)
+{
+    return vtype(value) == T_FUNC || vtype(value) == T_CFUNC;
+}
+
+bool js_iserr(jsval_t value)
+{
+    return vtype(value) == T_ERR;
+}
+
+jsval_t js_glob(struct js *js)
+{
+    (void)js;
+    return mkval(T_OBJ, 0);//全局scope总是第一个entity
+}
+
+const char *js_errmsg(struct js *js)
+{
+    return js->errmsg;
+}
+
+void js_setuserdata(struct js *js, void *udata)
+{
+    js->udata = udata;
+}
+
+void *js_getuserdata(struct js *js)
+{
+    return js->udata;
+}
+
+void js_setmaxcss(struct js *js, size_t max)
+{
+    js->maxcss = max > 0xffffffffU ? 0xffffffffU : (jsoff_t)max;
+}
+
+/*
+    从最外层的js_run开始用了多少C栈，超过maxcss返回true。
+    递归调用js函数每一层要走call_js、js_run、js_stmt、expr_loop好几个C函数，
+    只靠arena的大小限制不住，arena很大的时候会先把C栈用完。
+*/
+static bool cstack_over(struct js *js)
+{
+    volatile char here;
+    uintptr_t a = (uintptr_t)js->cstk, b = (uintptr_t)&here;
+    size_t used = a > b ? a - b : b - a;
+    if (used > js->css) {
+        js->css = (jsoff_t)used;
+    }
+    return js->maxcss != 0 && used > js->maxcss;
 }
+#define OBJ_MKSLOTS 4 //js_mkobj预留的slot个数
+
+static jsval_t mkslotobj(struct js *js, jsoff_t cap);
+
 jsval_t js_mkobj(struct js *js)
 {
-    return mkobj(js, 0);
+    return mkslotobj(js, OBJ_MKSLOTS);
 }
 
 jsval_t js_mkfun(jsval_t (*fn)(struct js *, jsval_t *, int))
 {
-    return mkval(T_FUNC, (size_t)(void *)fn);
+    return mkval(T_CFUNC, (size_t)(void *)fn);
 }
 
+static void mark(struct js *js, struct jsmark *m);
+
+/*
+    只清结构体，arena不用清：所有entity都是先写再读的，
+    大的arena在真正用到之前不会碰到它的内存页。
+*/
 struct js * js_create(void *buf, size_t len)
 {
     struct js *js = NULL;
     if (len < sizeof(*js) + esize(T_OBJ)) {
         return js;
     }
-    memset(buf, 0, len);
+    memset(buf, 0, sizeof(*js));
     js = (struct js *)buf;
     js->mem = (uint8_t *)(js+1);//先跳过js结构体大小，再把指针转成uint8_t的。
     js->size = (jsoff_t)(len - sizeof(*js));
     js->scope = mkobj(js, 0);
     js->size = js->size/8U * 8U;// 8字节对齐
+    js->argmin = js->size;
     js->lwm = js->size;
     js->gct = js->size/2;
+    js->maxcss = JS_MAXCSS;
+    mark(js, &js->base);
     return js;
 }
+#define NUM_MAXDIGITS 768 //再多的数字对double的舍入没有影响了
+#define NUM_BUFSZ 32 //fmtnum输出需要的buffer大小
+
+static const double pow10tab[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+    解析数字字面量，最多读len个字节，*n返回用掉的长度。
+    有效数字不超过19位、尾数不超过2^53、10的指数在±22以内的时候，
+    一次乘除就是精确结果（Clinger快速路径），整数是最常见的情况。
+    其他情况把数字整理成"数字串e指数"的形式交给strtod，
+    不带小数点，所以和locale无关。
+*/
+static double parsenum(const char *buf, jsoff_t len, jsoff_t *n)
+{
+    char tmp[NUM_MAXDIGITS + 16];
+    uint64_t m = 0;
+    int ndig = 0, exp10 = 0;
+    bool sticky = false, frac = false;
+    jsoff_t i = 0;
+    if (len > 2 && buf[0] == '0' && (buf[1] | 0x20) == 'x' && is_xdigit(buf[2])) {
+        double d = 0;
+        for (i = 2; i < len && is_xdigit(buf[i]); i++) {
+            d = d * 16 + unhex(buf[i]);
+        }
+        *n = i;
+        return d;
+    }
+    for (; i < len; i++) {
+        if (buf[i] == '.' && !frac) {
+            frac = true;
+            continue;
+        }
+        if (!is_digit(buf[i])) {
+            break;
+        }
+        if (ndig == 0 && buf[i] == '0') {
+            exp10 -= frac;//前导0
+        } else if (ndig < NUM_MAXDIGITS) {
+            if (ndig < 19) {
+                m = m * 10 + (uint64_t)(buf[i] - '0');
+            }
+            tmp[ndig++] = buf[i];
+            exp10 -= frac;
+        } else {
+            sticky |= buf[i] != '0';//丢掉的数字只记录是不是全0
+            exp10 += !frac;
+        }
+    }
+    if (i < len && (buf[i] | 0x20) == 'e') {
+        jsoff_t j = i + 1;
+        int sign = 1, e = 0;
+        if (j < len && (buf[j] == '+' || buf[j] == '-')) {
+            sign = buf[j++] == '-' ? -1 : 1;
+        }
+        if (j < len && is_digit(buf[j])) {
+            for (; j < len && is_digit(buf[j]); j++) {
+                if (e < 100000) {
+                    e = e * 10 + buf[j] - '0';
+                }
+            }
+            exp10 += sign * e;
+            i = j;
+        }
+    }
+    *n = i;
+    if (ndig == 0) {
+        return 0;
+    }
+    if (ndig <= 19 && m <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        return exp10 < 0 ? (double)m / pow10tab[-exp10] : (double)m * pow10tab[exp10];
+    }
+    if (sticky) {
+        tmp[ndig++] = '1';
+        exp10--;
+    }
+    snprintf(&tmp[ndig], sizeof(tmp) - (size_t)ndig, "e%d", exp10);
+    return strtod(tmp, NULL);
+}
+
+static size_t fmtint(uint64_t v, char *buf)
+{
+    char tmp[20];
+    size_t n = 0, i = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) {
+        buf[i++] = tmp[--n];
+    }
+    return i;
+}
+
+/*
+    Grisu2（Florian Loitsch, Printing Floating-Point Numbers Quickly and Accurately）。
+    用64位的整数近似计算，结果一定能原样解析回来，绝大部分情况下也是最短的，
+    极少数情况会多一位。只用整数乘法，不需要snprintf和再解析一遍。
+*/
+struct diyfp {
+    uint64_t f;
+    int e;
+};
+
+//10^(-348+8i)规格化成64位以后的f和e
+static const struct diyfp pow10cache[] = {
+    {0xfa8fd5a0081c0288ULL, -1220}, {0xbaaee17fa23ebf76ULL, -1193}, {0x8b16fb203055ac76ULL, -1166},
+    {0xcf42894a5dce35eaULL, -1140}, {0x9a6bb0aa55653b2dULL, -1113}, {0xe61acf033d1a45dfULL, -1087},
+    {0xab70fe17c79ac6caULL, -1060}, {0xff77b1fcbebcdc4fULL, -1034}, {0xbe5691ef416bd60cULL, -1007},
+    {0x8dd01fad907ffc3cULL, -980}, {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+    {0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874}, {0x823c12795db6ce57ULL, -847},
+    {0xc21094364dfb5637ULL, -821}, {0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768},
+    {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715}, {0xb23867fb2a35b28eULL, -688},
+    {0x84c8d4dfd2c63f3bULL, -661}, {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+    {0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555}, {0xf3e2f893dec3f126ULL, -529},
+    {0xb5b5ada8aaff80b8ULL, -502}, {0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449},
+    {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396}, {0xa6dfbd9fb8e5b88fULL, -369},
+    {0xf8a95fcf88747d94ULL, -343}, {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+    {0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236}, {0xe45c10c42a2b3b06ULL, -210},
+    {0xaa242499697392d3ULL, -183}, {0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130},
+    {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL, -77}, {0x9c40000000000000ULL, -50},
+    {0xe8d4a51000000000ULL, -24}, {0xad78ebc5ac620000ULL, 3}, {0x813f3978f8940984ULL, 30},
+    {0xc097ce7bc90715b3ULL, 56}, {0x8f7e32ce7bea5c70ULL, 83}, {0xd5d238a4abe98068ULL, 109},
+    {0x9f4f2726179a2245ULL, 136}, {0xed63a231d4c4fb27ULL, 162}, {0xb0de65388cc8ada8ULL, 189},
+    {0x83c7088e1aab65dbULL, 216}, {0xc45d1df942711d9aULL, 242}, {0x924d692ca61be758ULL, 269},
+    {0xda01ee641a708deaULL, 295}, {0xa26da3999aef774aULL, 322}, {0xf209787bb47d6b85ULL, 348},
+    {0xb454e4a179dd1877ULL, 375}, {0x865b86925b9bc5c2ULL, 402}, {0xc83553c5c8965d3dULL, 428},
+    {0x952ab45cfa97a0b3ULL, 455}, {0xde469fbd99a05fe3ULL, 481}, {0xa59bc234db398c25ULL, 508},
+    {0xf6c69a72a3989f5cULL, 534}, {0xb7dcbf5354e9beceULL, 561}, {0x88fcf317f22241e2ULL, 588},
+    {0xcc20ce9bd35c78a5ULL, 614}, {0x98165af37b2153dfULL, 641}, {0xe2a0b5dc971f303aULL, 667},
+    {0xa8d9d1535ce3b396ULL, 694}, {0xfb9b7cd9a4a7443cULL, 720}, {0xbb764c4ca7a44410ULL, 747},
+    {0x8bab8eefb6409c1aULL, 774}, {0xd01fef10a657842cULL, 800}, {0x9b10a4e5e9913129ULL, 827},
+    {0xe7109bfba19c0c9dULL, 853}, {0xac2820d9623bf429ULL, 880}, {0x80444b5e7aa7cf85ULL, 907},
+    {0xbf21e44003acdd2dULL, 933}, {0x8e679c2f5e44ff8fULL, 960}, {0xd433179d9c8cb841ULL, 986},
+    {0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039}, {0xaf87023b9bf0ee6bULL, 1066},
+};
+
+static struct diyfp diyfp_mul(struct diyfp x, struct diyfp y)
+{
+    const uint64_t M32 = 0xffffffffU;
+    uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1U << 31);//四舍五入
+    struct diyfp r = {ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+    return r;
+}
+
+static struct diyfp diyfp_norm(struct diyfp x)
+{
+    while (!(x.f & (1ULL << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+        (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+//d > 0，有限。digits返回有效数字，*k返回个数，返回值是第一位数字的10的指数，和%e一样
+static int grisu2(double d, char *digits, int *k)
+{
+    static const uint64_t pow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+        100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+        10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+    };
+    uint64_t u = tov(d);
+    int be = (int)((u >> 52) & 0x7ff);
+    struct diyfp v = {u & ((1ULL << 52) - 1), be != 0 ? be - 1075 : -1074};
+    if (be != 0) {
+        v.f += 1ULL << 52;
+    }
+    //取值范围的上下边界m+和m-，m-和m+的指数对齐
+    struct diyfp wp = {(v.f << 1) + 1, v.e - 1}, wm;
+    while (!(wp.f & (1ULL << 53))) {
+        wp.f <<= 1;
+        wp.e--;
+    }
+    wp.f <<= 10;
+    wp.e -= 10;
+    if (v.f == (1ULL << 52)) {
+        wm.f = (v.f << 2) - 1;
+        wm.e = v.e - 2;
+    } else {
+        wm.f = (v.f << 1) - 1;
+        wm.e = v.e - 1;
+    }
+    wm.f <<= wm.e - wp.e;
+    wm.e = wp.e;
+    //选一个10^-K，让乘出来的指数落在[-60, -32]里面
+    double dk = (-61 - wp.e) * 0.30102999566398114 + 347;
+    int kk = (int)dk;
+    if (dk - kk > 0.0) {
+        kk++;
+    }
+    int idx = (kk >> 3) + 1;
+    int K = -(-348 + idx * 8);
+    struct diyfp c = pow10cache[idx];
+    struct diyfp w = diyfp_mul(diyfp_norm(v), c);
+    wp = diyfp_mul(wp, c);
+    wm = diyfp_mul(wm, c);
+    wm.f++;
+    wp.f--;
+    //逐位生成数字，一旦剩下的误差小于delta就停下来
+    uint64_t delta = wp.f - wm.f, wp_w = wp.f - w.f;
+    int shift = -wp.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t p1 = (uint32_t)(wp.f >> shift);
+    uint64_t p2 = wp.f & (one - 1);
+    int kappa = 0, len = 0;
+    while (kappa < 10 && p1 >= pow10[kappa]) {
+        kappa++;
+    }
+    while (kappa > 0) {
+        uint32_t dg = (uint32_t)(p1 / pow10[kappa - 1]);
+        p1 %= (uint32_t)pow10[kappa - 1];
+        if (dg != 0 || len != 0) {
+            digits[len++] = (char)('0' + dg);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            K += kappa;
+            grisu_round(digits, len, delta, rest, pow10[kappa] << shift, wp_w);
+            *k = len;
+            return K + len - 1;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char dg = (char)(p2 >> shift);
+        if (dg != 0 || len != 0) {
+            digits[len++] = (char)('0' + dg);
+        }
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            K += kappa;
+            grisu_round(digits, len, delta, p2, one, -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+            *k = len;
+            return K + len - 1;
+        }
+    }
+}
+
+/*
+    输出能原样解析回来的十进制表示，格式和Number.prototype.toString一样。
+    整数直接转，其他的用grisu2取数字，小数点自己拼，和locale无关。
+    buf至少要NUM_BUFSZ字节，返回长度，不以0结尾。
+*/
+static size_t fmtnum(double d, char *buf)
+{
+    char digits[20];
+    int k = 0, exp = 0;
+    size_t i = 0;
+    if (isnan(d)) {
+        memcpy(buf, "NaN", 3);
+        return 3;
+    }
+    if (d < 0) {
+        buf[i++] = '-';
+        d = -d;
+    }
+    if (isinf(d)) {
+        memcpy(&buf[i], "Infinity", 8);
+        return i + 8;
+    }
+    if (d == 0) {
+        buf[0] = '0';//-0也输出0
+        return 1;
+    }
+    if (d < 9007199254740992.0 && d == (double)(uint64_t)d) {
+        return i + fmtint((uint64_t)d, &buf[i]);
+    }
+    exp = grisu2(d, digits, &k);
+    while (k > 1 && digits[k - 1] == '0') {
+        k--;
+    }
+    int e = exp + 1;//d = 0.digits * 10^e
+    if (k <= e && e <= 21) {
+        memcpy(&buf[i], digits, (size_t)k);
+        i += (size_t)k;
+        for (; k < e; k++) {
+            buf[i++] = '0';
+        }
+    } else if (0 < e && e <= 21) {
+        memcpy(&buf[i], digits, (size_t)e);
+        i += (size_t)e;
+        buf[i++] = '.';
+        memcpy(&buf[i], &digits[e], (size_t)(k - e));
+        i += (size_t)(k - e);
+    } else if (-6 < e && e <= 0) {
+        buf[i++] = '0';
+        buf[i++] = '.';
+        for (; e < 0; e++) {
+            buf[i++] = '0';
+        }
+        memcpy(&buf[i], digits, (size_t)k);
+        i += (size_t)k;
+    } else {
+        buf[i++] = digits[0];
+        if (k > 1) {
+            buf[i++] = '.';
+            memcpy(&buf[i], &digits[1], (size_t)(k - 1));
+            i += (size_t)(k - 1);
+        }
+        buf[i++] = 'e';
+        buf[i++] = exp < 0 ? '-' : '+';
+        i += fmtint((uint64_t)(exp < 0 ? -exp : exp), &buf[i]);
+    }
+    return i;
+}
+
 /*
     n表示当前的解析的位置
     跳到下一个有效字符上。
@@ -608,8 +1136,9 @@ static uint8_t parseident(const char* buf, jsoff_t len, jsoff_t *tlen)
 {
     if (is_ident_begin(buf[0])) {
         while (*tlen < len && is_ident_continue(buf[*tlen])) {
-            return parsekeyword(buf, *tlen);
+            (*tlen)++;
         }
+        return parsekeyword(buf, *tlen);
     }
     return TOK_ERR;
 }
@@ -694,15 +1223,17 @@ static uint8_t next(struct js *js)
         case '9':
             //数字的情况
             {
-                char *end;
-                js->tval = tov(strtod(buf, &end));
-                TOK(TOK_NUMBER, (jsoff_t)(end - buf));//这里面有braek了
+                jsoff_t n = 0;
+                js->tval = mknum(parsenum(buf, js->clen - js->toff, &n));
+                TOK(TOK_NUMBER, n);//这里面有braek了
             }
         default://默认就是普通字母的情况。
             js->tok = parseident(buf, js->clen - js->toff, &js->tlen);
             break;
 
     }
+    js->pos = js->toff + js->tlen;//pos移到tok后面
+    return js->tok;
 }
 
 static jsval_t js_continue(struct js *js)
@@ -724,9 +1255,8 @@ static jsval_t resolveprop(struct js *js, jsval_t v)
     if (vtype(v) != T_PROP) {
         return v;
     }
-    return resolveprop(js, 
-        loadval(js, (jsoff_t)(vdata(v) + sizeof(jsoff_t)*2));
-    )
+    return resolveprop(js,
+        loadval(js, (jsoff_t)(vdata(v) + sizeof(jsoff_t)*2)));
 }
 
 jsval_t js_mkstr(struct js *js, const void *ptr, size_t len)
@@ -754,240 +1284,4045 @@ static jsoff_t offtolen(jsoff_t off)
     return (off>>2) - 1;
 }
 /*
-    返回js 字符串的mem offset和长度
+    外部字符串：T_STR的值指向一个blob而不是T_STR entity，
+    blob里面是[host指针][长度][release回调][链表里下一个外部字符串的offset]。
+*/
+struct jsxstr {
+    const char *ptr;
+    size_t len;
+    void (*release)(void *);
+    jsoff_t next;
+};
+
+static bool is_xstr(struct js *js, jsval_t value)
+{
+    return (loadoff(js, (jsoff_t)vdata(value)) & 3U) == E_BLOB;
+}
+
+static struct jsxstr loadxstr(struct js *js, jsval_t value)
+{
+    struct jsxstr x;
+    memcpy(&x, &js->mem[vdata(value) + sizeof(jsoff_t)], sizeof(x));
+    return x;
+}
+
+/*
+    返回js字符串的内容和长度，外部字符串直接返回host的指针，不拷贝。
 */
-static jsoff_t vstr(struct js* js, jsval_t value, jsoff_t *len)
+static const char *vstr(struct js* js, jsval_t value, jsoff_t *len)
 {
     jsoff_t off = (jsoff_t)vdata(value);
+    if (is_xstr(js, value)) {
+        struct jsxstr x = loadxstr(js, value);
+        if (len) {
+            *len = (jsoff_t)x.len;
+        }
+        return x.ptr;
+    }
     if (len) {
         *len = offtolen(loadoff(js, off));
     }
-    return (jsoff_t)(off + sizeof(off));
+    return (const char *)&js->mem[off + sizeof(off)];
 }
 
-static jsval_t upper(struct js *js, jsval_t scope)
+static void undolog(struct js *js, jsoff_t off, jsoff_t n);
+
+static void saveoff(struct js *js, jsoff_t off, jsoff_t val)
 {
-    return mkval(T_OBJ, 
-        loadoff(js, (jsoff_t)(vdata(scope) + sizeof(jsoff_t)))
-    );
+    undolog(js, off, sizeof(val));
+    memcpy(&js->mem[off], &val, sizeof(val));
 }
-static void mkscope(struct js *js)
+
+static void saveval(struct js *js, jsoff_t off, jsval_t val)
 {
-    assert((js->flags & F_NOEXEC) == 0);//那就要确保要exe
-    jsoff_t prev = (jsoff_t)vdata(js->scope);
-    js->scope = mkobj(js, prev);
+    undolog(js, off, sizeof(val));
+    memcpy(&js->mem[off], &val, sizeof(val));
 }
 
-static void delscope(struct js *js)
+/*
+    分配一个n字节的blob，返回它的offset，内存不够返回~0。
+*/
+static jsoff_t mkblob(struct js *js, const void *buf, jsoff_t n)
 {
-    js->scope = upper(js, js->scope);
+    jsval_t v = mkentity(js, (n << 2) | E_BLOB, buf, n);
+    return is_err(v) ? ~0U : (jsoff_t)vdata(v);
 }
-static jsval_t call_js(struct js *js, const char *fn, jsoff_t fnlen)
+
+/*
+    mark之前的内存被改写之前，把原来的内容记到undo log里面，rollback的时候倒着写回去，
+    这样mark之前的全局变量、对象和数组被赋成mark之后的值，rollback以后也不会指到退掉的内存。
+    log的每一项是一个blob：[上一项][offset][字节数][原来的内容]，分配在mark后面，跟着一起退掉。
+    全局对象的prop链表头rollback自己恢复，不用记。
+    循环里面反复给同一个变量赋值的时候，最近几项里面已经记过的不再记，不然log会把arena用完。
+    往前找到ubrk下面为止，下面的项是外面一层mark的，这一层还要自己记。
+*/
+#define UNDO_SCAN 8
+
+static void undolog(struct js *js, jsoff_t off, jsoff_t n)
 {
-    jsoff_t fnpos = 1;
-    mkscope(js);//创建函数调用scope
-    while (fnpos < fnlen) {
-        fnpos = skiptonext(fn, fnlen, fnpos);
-        if (fnpos < fnlen && fn[fnpos] == ')') {
-            break;
-        }
-        jsoff_t identlen = 0;
-        uint8_t tok = parseident(&fn[fnpos], fnlen-fnpos, &identlen);
-        if (tok != TOK_IDENTIFIER) {
-            break;
+    jsoff_t hdr[3] = {js->undo, off, n};
+    if (off >= js->ubrk || off < esize(T_OBJ)) {
+        return;
+    }
+    jsoff_t e = js->undo;
+    for (int i = 0; i < UNDO_SCAN && e >= js->ubrk; i++) {
+        jsoff_t old[3];
+        memcpy(old, &js->mem[e + sizeof(jsoff_t)], sizeof(old));
+        if (old[1] == off && old[2] == n) {
+            return;//rollback倒着恢复，最早记的那一项最后写，后面的改写不用再记
         }
-        // 到这里，我们拿到了arg name，计算arg value
-        
+        e = old[0];
+    }
+    e = mkblob(js, NULL, (jsoff_t)sizeof(hdr) + n);
+    if (e == ~0U) {
+        myloge("undo log oom");//rollback以后这次改写不会恢复
+        return;
     }
+    memcpy(&js->mem[e + sizeof(jsoff_t)], hdr, sizeof(hdr));
+    memcpy(&js->mem[e + sizeof(jsoff_t) + sizeof(hdr)], &js->mem[off], n);
+    js->undo = e;
 }
-static jsval_t do_call_op(struct js *js, jsval_t func, jsval_t args)
+
+/*
+    紧凑对象：T_OBJ后面紧跟着一个slot blob，前面几个prop的值直接放在slot里面，
+    key放在shape里面，key相同、顺序相同的对象共用一个shape。
+    T_OBJ的parent字段最低位是OBJ_SLOTS表示后面有slot blob。
+    slot blob：[shape的offset][cap个jsval_t]，用了几个slot看shape里面key的个数。
+    shape blob：[上一个shape的offset][key的个数n][n个key的offset]，0是空shape。
+    slot放满以后的prop还是挂在T_PROP链表上。
+    slot没有T_PROP entity，对外用"slot地址-8"当作T_PROP，
+    这样resolveprop和赋值在vdata+8读写的正好就是slot。
+*/
+#define OBJ_INLINE 8 //JSON对象最多放几个inline slot
+#define OBJ_SLOTS 1U
+#define SHAPE_CACHE 64 //shape转换缓存的大小，必须是2的幂
+
+static bool has_slots(struct js *js, jsval_t obj)
 {
-    if (vtype(args) != T_CODEREF) {
-        return js_mkerr(js, "bad call");
-    }
-    if (vtype(func) != T_FUNC && vtype(func) != T_CFUNC) {
-        return js_mkerr(js, "calling non-function");
-    }
-    const char *code = js->code;
-    jsoff_t clen = js->clen;
-    jsoff_t pos = js->pos;
-    js->code = &js->code[coderefoff(args)];
-    js->clen = codereflen(args);
-    js->pos = skiptonext(js->code, js->clen, 0);//调到第一个参数上
-    uint8_t tok = js->tok;
-    uint8_t flags = js->flags;//保存flags
-    jsoff_t nogc = js->nogc;
-    jsval_t res = js_mkundef();
-    if (vtype(func) == T_FUNC) {
-        jsoff_t fnlen = 0;
-        jsoff_t fnoff = vstr(js, func, &fnlen);//拿到函数名字
-        js->nogc = (jsoff_t)(fnoff - sizeof(jsoff_t));//标记这个内容不要被gc回收。
-        res = call_js(js, (const char *)(&js->mem[fnoff]), fnlen);
-    } else {
-        res = call_c(js, (jsval_t (*)(struct js*, jsval_t*, int))vdata(func));
-    }
+    return (loadoff(js, (jsoff_t)vdata(obj) + sizeof(jsoff_t)) & OBJ_SLOTS) != 0;
+}
 
+//slot blob紧跟在8字节的T_OBJ后面
+static jsoff_t slotblob(jsval_t obj)
+{
+    return (jsoff_t)vdata(obj) + (jsoff_t)sizeof(jsoff_t) * 2;
 }
-static jsval_t do_op(strut js* js, uint8_t op, jsval_t lhs, jsval_t rhs)
+
+static jsoff_t slotcap(struct js *js, jsval_t obj)
 {
-    if (js->flags & F_NOEXEC) {
-        return 0;//返回0意义是什么？
-    }
-    jsval_t l = resolveprop(js, lhs);
-    jsval_t r = resolveprop(js, rhs);
-    // setlwm(js); TODO
-    if (is_err(l)) {
-        return l;
-    }
-    if (is_err(r)) {
-        return r;
-    }
-    if (is_assign(op) && vtype(lhs) != T_PROP) {
-        return js_mkerr(js, "bad lhs");
-    }
-    switch (op) {
-        // typeof是运算符号，所以可以不加括号的, typeof a这样。
-        case TOK_TYPEOF:
-            return js_mkstr(js, typestr(vtype(r)), strlen(typestr(vtype(r))));
-        case TOK_CALL:
-            return do_call_op(js, l, r);
-        
-    }
-}
-// 从右到左的二元操作
-#define RTL_BINOP(_f1, _f2, _cond)  \
-    jsval_t res = _f1(js);                 \
-    while (!(is_err(res)) && (_cond)) {    \
-        uint8_t op = js->tok;              \
-        js->consumed = 1;                  \
-        jsval_t rhs = _f2(js);             \
-        if (is_err(rhs)) {                 \
-            return rhs;                    \
-        }                                  \
-        res = do_op(js, op, res, rhs);     \
-    }                                      \
-    return res;
-static jsval_t js_break(struct js *js)
+    return ((loadoff(js, slotblob(obj)) >> 2) - (jsoff_t)sizeof(jsoff_t)) / (jsoff_t)sizeof(jsval_t);
+}
+
+static jsoff_t slotoff(jsval_t obj, jsoff_t i)
 {
-    if (js->flags & F_NOEXEC) {
-        //
-    } else {
-        if (!(js->flags & F_LOOP)) {
-            return js_mkerr(js, "not in loop");
-        }
-        js->flags |= F_BREAK | F_NOEXEC;
-    }
-    js->consumed = 1;
-    return js_mkundef();
+    return slotblob(obj) + (jsoff_t)sizeof(jsoff_t) * 2 + i * (jsoff_t)sizeof(jsval_t);
 }
-//这是三元操作符 TODO
-static jsval_t js_tenary(struct js *js)
+
+static jsoff_t objshape(struct js *js, jsval_t obj)
 {
-    jsval_t res = js_mkundef();
-    return res;
+    return loadoff(js, slotblob(obj) + sizeof(jsoff_t));
 }
-static jsval_t js_assignment(struct js *js)
-{
-    RTL_BINOP(js_ternary, js_assignment, 
-        (next(js) == TOK_ASSIGN || js->tok == TOK_PLUS_ASSIGN \
-            || js->tok == TOK_MINUS_ASSIGN \
-            || js->tok == TOK_MUL_ASSIGN \
-            || js->tok == TOK_DIV_ASSIGN \
-            || js->tok == TOK_REM_ASSIGN \
-            || js->tok == TOK_SHL_ASSIGN \
-            || js->tok == TOK_SHR_ASSIGN \
-            || js->tok == TOK_ZSHR_ASSIGN \
-            || js->tok == TOK_AND_ASSIGN \
-            || js->tok == TOK_OR_ASSIGN \
-            || js->tok == TOK_XOR_ASSIGN \
-        )
+
+static jsoff_t shapelen(struct js *js, jsoff_t shape)
+{
+    return shape == 0 ? 0 : loadoff(js, shape + sizeof(jsoff_t) * 2);
+}
+
+static jsoff_t shapekey(struct js *js, jsoff_t shape, jsoff_t i)
+{
+    return loadoff(js, shape + (jsoff_t)sizeof(jsoff_t) * (3 + i));
+}
+
+static uint32_t hashstr(const char *p, size_t n)
+{
+    uint32_t h = 2166136261U;//FNV-1a
+    while (n-- > 0) {
+        h = (h ^ (uint8_t)*p++) * 16777619U;
+    }
+    return h;
+}
+
+static bool keyeq(struct js *js, jsoff_t koff, const char *name, size_t len)
+{
+    return streq((const char *)&js->mem[koff + sizeof(koff)], offtolen(loadoff(js, koff)), name, len);
+}
+
+static jsoff_t shapetab(struct js *js)
+{
+    if (js->shapes == 0) {
+        js->shapes = mkblob(js, NULL, SHAPE_CACHE * sizeof(jsoff_t));
+        if (js->shapes != ~0U) {
+            memset(&js->mem[js->shapes + sizeof(jsoff_t)], 0, SHAPE_CACHE * sizeof(jsoff_t));
+        }
+    }
+    return js->shapes;
+}
+
+/*
+    在shape后面加一个key，先查转换缓存，key按内容比较，
+    所以不同来源（比如每条JSON记录各自解析出来的key）也能共用shape。
+*/
+static jsoff_t shape_add(struct js *js, jsoff_t shape, jsoff_t koff)
+{
+    jsoff_t n = shapelen(js, shape), klen = offtolen(loadoff(js, koff));
+    const char *k = (const char *)&js->mem[koff + sizeof(koff)];
+    jsoff_t keys[OBJ_INLINE + 2];
+    if (n >= OBJ_INLINE) {
+        return ~0U;
+    }
+    if (shapetab(js) == ~0U) {
+        return ~0U;
+    }
+    jsoff_t slot = js->shapes + (jsoff_t)sizeof(jsoff_t) *
+        (1 + ((hashstr(k, klen) ^ shape) & (SHAPE_CACHE - 1)));
+    jsoff_t cand = loadoff(js, slot);
+    if (cand != 0 && loadoff(js, cand + sizeof(jsoff_t)) == shape &&
+        keyeq(js, shapekey(js, cand, n), k, klen)) {
+        return cand;
+    }
+    keys[0] = shape;
+    keys[1] = n + 1;
+    for (jsoff_t i = 0; i < n; i++) {
+        keys[2 + i] = shapekey(js, shape, i);
+    }
+    keys[2 + n] = koff;
+    cand = mkblob(js, keys, (n + 3) * (jsoff_t)sizeof(jsoff_t));
+    if (cand != ~0U) {
+        saveoff(js, slot, cand);
+    }
+    return cand;
+}
+
+/*
+    T_OBJ和slot blob一次分配，保证挨在一起。
+*/
+static jsval_t mkslotobj(struct js *js, jsoff_t cap)
+{
+    jsoff_t blen = (jsoff_t)sizeof(jsoff_t) + cap * (jsoff_t)sizeof(jsval_t);
+    jsoff_t off = js_alloc(js, sizeof(jsoff_t) * 3 + blen);
+    if (off == ~0U) {
+        return js_mkerr(js, "oom");
+    }
+    saveoff(js, off, T_OBJ);
+    saveoff(js, off + sizeof(jsoff_t), OBJ_SLOTS);
+    saveoff(js, off + sizeof(jsoff_t) * 2, (blen << 2) | E_BLOB);
+    saveoff(js, off + sizeof(jsoff_t) * 3, 0);
+    return mkval(T_OBJ, off);
+}
+
+/*
+    返回key所在的slot下标，没有返回~0。
+*/
+static jsoff_t slotidx(struct js *js, jsval_t obj, const char *name, size_t len)
+{
+    jsoff_t shape = objshape(js, obj);
+    for (jsoff_t i = 0, n = shapelen(js, shape); i < n; i++) {
+        if (keyeq(js, shapekey(js, shape, i), name, len)) {
+            return i;
+        }
+    }
+    return ~0U;
+}
+
+/*
+    放进slot，key已经在shape里面就直接覆盖。slot满了返回undefined。
+*/
+static jsval_t setslot(struct js *js, jsval_t obj, jsval_t k, jsval_t v)
+{
+    jsoff_t koff = (jsoff_t)vdata(k), shape = objshape(js, obj);
+    jsoff_t i = slotidx(js, obj, (const char *)&js->mem[koff + sizeof(koff)],
+        offtolen(loadoff(js, koff)));
+    if (i == ~0U) {
+        i = shapelen(js, shape);
+        if (i >= slotcap(js, obj) || (shape = shape_add(js, shape, koff)) == ~0U) {
+            return js_mkundef();
+        }
+        saveoff(js, slotblob(obj) + sizeof(jsoff_t), shape);
+    }
+    saveval(js, slotoff(obj, i), v);
+    return mkval(T_PROP, slotoff(obj, i) - sizeof(jsoff_t) * 2);
+}
+
+/*
+    prop的内存布局：[next prop的offset | T_PROP][key的offset][value]
+*/
+static jsval_t mkprop(struct js *js, jsoff_t next, jsval_t k, jsval_t v)
+{
+    jsoff_t koff = (jsoff_t)vdata(k);
+    char buf[sizeof(koff) + sizeof(v)];
+    memcpy(buf, &koff, sizeof(koff));
+    memcpy(buf + sizeof(koff), &v, sizeof(v));
+    return mkentity(js, (next & ~3U) | T_PROP, buf, sizeof(buf));
+}
+
+/*
+    新的prop插入到obj的prop链表的头部。
+*/
+static jsval_t setprop(struct js *js, jsval_t obj, jsval_t k, jsval_t v)
+{
+    if (has_slots(js, obj)) {
+        jsval_t res = setslot(js, obj, k, v);
+        if (vtype(res) != T_UNDEF) {
+            return res;
+        }
+    }
+    jsoff_t head = (jsoff_t)vdata(obj);
+    jsoff_t first = loadoff(js, head);
+    jsval_t prop = mkprop(js, first, k, v);
+    if (!is_err(prop)) {
+        jsoff_t b = (jsoff_t)vdata(prop) | T_OBJ;
+        saveoff(js, head, b);//head指向新的prop
+    }
+    return prop;
+}
+
+jsval_t js_set(struct js *js, jsval_t obj, const char *key, jsval_t val)
+{
+    if (vtype(obj) != T_OBJ) {
+        return js_mkerr(js, "not an object");
+    }
+    jsval_t k = js_mkstr(js, key, strlen(key));
+    if (is_err(k)) {
+        return k;
+    }
+    return setprop(js, obj, k, val);
+}
+
+/*
+    先找inline slot，再找prop链表，返回T_PROP，找不到返回undefined。
+*/
+static jsval_t lookup(struct js *js, jsval_t obj, const char *name, size_t len)
+{
+    if (has_slots(js, obj)) {
+        jsoff_t i = slotidx(js, obj, name, len);
+        if (i != ~0U) {
+            return mkval(T_PROP, slotoff(obj, i) - sizeof(jsoff_t) * 2);
+        }
+    }
+    for (jsoff_t off = loadoff(js, (jsoff_t)vdata(obj)) & ~3U; off != 0;
+        off = loadoff(js, off) & ~3U) {
+        if (keyeq(js, loadoff(js, off + sizeof(off)), name, len)) {
+            return mkval(T_PROP, off);
+        }
+    }
+    return js_mkundef();
+}
+
+jsval_t js_get(struct js *js, jsval_t obj, const char *key)
+{
+    if (vtype(obj) != T_OBJ) {
+        return js_mkundef();
+    }
+    return resolveprop(js, lookup(js, obj, key, strlen(key)));
+}
+
+/*
+    数组的内存布局：
+    head blob：[len][元素存储blob的offset]，数组的值指向head，扩容的时候head不动。
+    元素存储blob：连续的jsval_t，容量就是blob的字节数/8。
+    gc要把元素存储里面[0, len)的值都当作引用来扫描。
+*/
+#define ARR_MINCAP 4U
+#define ARR_MAXCAP (1U << 27) //blob头部只有30bit存字节数
+
+static jsoff_t arrstor(struct js *js, jsval_t arr)
+{
+    return loadoff(js, (jsoff_t)vdata(arr) + sizeof(jsoff_t) * 2);
+}
+
+static jsoff_t arrcap(struct js *js, jsoff_t stor)
+{
+    return (loadoff(js, stor) >> 2) / (jsoff_t)sizeof(jsval_t);
+}
+
+static jsoff_t arrlen(struct js *js, jsval_t arr)
+{
+    return loadoff(js, (jsoff_t)vdata(arr) + sizeof(jsoff_t));
+}
+
+static jsval_t mkarr(struct js *js, jsoff_t cap)
+{
+    jsoff_t head[2] = {0, 0};
+    if (cap > ARR_MAXCAP) {
+        return js_mkerr(js, "array too big");
+    }
+    head[1] = mkblob(js, NULL, cap * (jsoff_t)sizeof(jsval_t));
+    if (head[1] == ~0U) {
+        return js_mkerr(js, "oom");
+    }
+    jsoff_t h = mkblob(js, head, sizeof(head));
+    if (h == ~0U) {
+        return js_mkerr(js, "oom");
+    }
+    return mkval(T_ARR, h);
+}
+
+/*
+    容量不够的时候按2倍扩容，旧的元素存储还给free list。
+*/
+static jsval_t arrgrow(struct js *js, jsval_t arr, size_t need)
+{
+    jsoff_t stor = arrstor(js, arr), cap = arrcap(js, stor);
+    if (need <= cap) {
+        return arr;
+    }
+    if (need > ARR_MAXCAP) {
+        return js_mkerr(js, "array too big");
+    }
+    jsoff_t ncap = cap * 2 < ARR_MINCAP ? ARR_MINCAP : cap * 2;
+    if (ncap < need) {
+        ncap = (jsoff_t)need;
+    }
+    if (ncap > ARR_MAXCAP) {
+        ncap = ARR_MAXCAP;
+    }
+    jsoff_t nstor = mkblob(js, NULL, ncap * (jsoff_t)sizeof(jsval_t));
+    if (nstor == ~0U) {
+        return js_mkerr(js, "oom");
+    }
+    memcpy(&js->mem[nstor + sizeof(jsoff_t)], &js->mem[stor + sizeof(jsoff_t)],
+        arrlen(js, arr) * sizeof(jsval_t));
+    saveoff(js, (jsoff_t)vdata(arr) + sizeof(jsoff_t) * 2, nstor);
+    js_free(js, stor, esize(loadoff(js, stor)));
+    return arr;
+}
+
+/*
+    typed array的view blob：[host指针][元素个数][元素类型]。
+    元素直接读写host的内存，不在arena里面分配。
+*/
+struct jsview {
+    void *ptr;
+    jsoff_t len;
+    jsoff_t type;
+};
+
+static const uint8_t viewelsize[] = {1, 4, 8}; //按JS_UINT8/JS_INT32/JS_FLOAT64的顺序
+
+static struct jsview loadview(struct js *js, jsval_t v)
+{
+    struct jsview view;
+    memcpy(&view, &js->mem[vdata(v) + sizeof(jsoff_t)], sizeof(view));
+    return view;
+}
+
+/*
+    和JS的ToInt32一样，按2^32取模。
+*/
+static uint32_t touint32(double d)
+{
+    if (!isfinite(d)) {
+        return 0;
+    }
+    d = fmod(trunc(d), 4294967296.0);
+    if (d < 0) {
+        d += 4294967296.0;
+    }
+    return (uint32_t)d;
+}
+
+static jsval_t viewget(struct jsview *view, size_t idx)
+{
+    double d;
+    switch (view->type) {
+        case JS_UINT8:
+            return tov(((uint8_t *)view->ptr)[idx]);
+        case JS_INT32:
+            return tov(((int32_t *)view->ptr)[idx]);
+        default:
+            memcpy(&d, (uint8_t *)view->ptr + idx * sizeof(d), sizeof(d));
+            return mknum(d);//host里面的NaN也可能是正的
+    }
+}
+
+static void viewset(struct jsview *view, size_t idx, double d)
+{
+    switch (view->type) {
+        case JS_UINT8:
+            ((uint8_t *)view->ptr)[idx] = (uint8_t)touint32(d);
+            break;
+        case JS_INT32:
+            ((int32_t *)view->ptr)[idx] = (int32_t)touint32(d);
+            break;
+        default:
+            memcpy((uint8_t *)view->ptr + idx * sizeof(d), &d, sizeof(d));
+            break;
+    }
+}
+
+/*
+    len是host内存的字节数，元素个数是len/元素大小。
+    host要保证ptr在js实例的生命周期内一直有效。
+*/
+jsval_t js_mkbuffer_external(struct js *js, void *ptr, size_t len, int type)
+{
+    struct jsview view;
+    if (type < JS_UINT8 || type > JS_FLOAT64) {
+        return js_mkerr(js, "bad view type");
+    }
+    memset(&view, 0, sizeof(view));
+    view.ptr = ptr;
+    view.len = (jsoff_t)(len / viewelsize[type]);
+    view.type = (jsoff_t)type;
+    jsoff_t off = mkblob(js, &view, sizeof(view));
+    if (off == ~0U) {
+        return js_mkerr(js, "oom");
+    }
+    return mkval(T_VIEW, off);
+}
+
+/*
+    外部字符串不拷贝host的内存，release可以为NULL。
+    js_release_externals的时候对每个外部字符串调用release。
+*/
+jsval_t js_mkstr_external(struct js *js, const char *ptr, size_t len, void (*release)(void *))
+{
+    struct jsxstr x;
+    memset(&x, 0, sizeof(x));
+    x.ptr = ptr;
+    x.len = len;
+    x.release = release;
+    x.next = js->xstr;
+    jsoff_t off = mkblob(js, &x, sizeof(x));
+    if (off == ~0U) {
+        return js_mkerr(js, "oom");
+    }
+    js->xstr = off;
+    return mkval(T_STR, off);
+}
+
+void js_release_externals(struct js *js)
+{
+    jsoff_t off = js->xstr;
+    while (off != 0) {
+        struct jsxstr x = loadxstr(js, mkval(T_STR, off));
+        if (x.release != NULL) {
+            x.release((void *)x.ptr);
+        }
+        off = x.next;
+    }
+    js->xstr = 0;
+}
+
+/*
+    total是arena的大小，brk是用到的最高位置，
+    freeb是free list里面还能复用的字节数，reused是从free list分配的次数。
+*/
+void js_stats(struct js *js, size_t *total, size_t *brk, size_t *freeb, size_t *reused)
+{
+    size_t n = 0;
+    for (jsoff_t i = 0; i < sizeof(js->freel) / sizeof(js->freel[0]); i++) {
+        for (jsoff_t off = js->freel[i]; off != 0; off = loadoff(js, off + sizeof(off))) {
+            n += i * 4;
+        }
+    }
+    if (total) {
+        *total = js->size;
+    }
+    if (brk) {
+        *brk = js->brk;
+    }
+    if (freeb) {
+        *freeb = n;
+    }
+    if (reused) {
+        *reused = js->nreuse;
+    }
+}
+
+const char *js_getstr(struct js *js, jsval_t value, size_t *len)
+{
+    jsoff_t n = 0;
+    if (vtype(value) != T_STR) {
+        return NULL;
+    }
+    const char *p = vstr(js, value, &n);
+    if (len) {
+        *len = n;
+    }
+    return p;
+}
+
+jsval_t js_mkarr(struct js *js)
+{
+    return mkarr(js, 0);
+}
+
+size_t js_arr_len(struct js *js, jsval_t arr)
+{
+    if (vtype(arr) == T_VIEW) {
+        return loadview(js, arr).len;
+    }
+    return vtype(arr) == T_ARR ? arrlen(js, arr) : 0;
+}
+
+jsval_t js_arr_get(struct js *js, jsval_t arr, size_t idx)
+{
+    if (vtype(arr) == T_VIEW) {
+        struct jsview view = loadview(js, arr);
+        return idx < view.len ? viewget(&view, idx) : js_mkundef();
+    }
+    if (vtype(arr) != T_ARR || idx >= arrlen(js, arr)) {
+        return js_mkundef();
+    }
+    return loadval(js, arrstor(js, arr) + sizeof(jsoff_t) + (jsoff_t)idx * sizeof(jsval_t));
+}
+
+/*
+    写到len后面的时候中间的空位填undefined。
+*/
+jsval_t js_arr_set(struct js *js, jsval_t arr, size_t idx, jsval_t val)
+{
+    if (vtype(arr) == T_VIEW) {
+        //typed array长度固定，越界写忽略掉，非数字写成NaN
+        struct jsview view = loadview(js, arr);
+        if (idx < view.len) {
+            viewset(&view, idx, vtype(val) == T_NUM ? tod(val) : NAN);
+        }
+        return val;
+    }
+    if (vtype(arr) != T_ARR) {
+        return js_mkerr(js, "not an array");
+    }
+    jsoff_t len = arrlen(js, arr);
+    if (idx >= len) {
+        jsval_t res = arrgrow(js, arr, idx + 1);
+        if (is_err(res)) {
+            return res;
+        }
+        jsoff_t stor = arrstor(js, arr);
+        for (; len < idx; len++) {
+            saveval(js, stor + sizeof(jsoff_t) + len * sizeof(jsval_t), js_mkundef());
+        }
+        saveoff(js, (jsoff_t)vdata(arr) + sizeof(jsoff_t), (jsoff_t)idx + 1);
+    }
+    saveval(js, arrstor(js, arr) + sizeof(jsoff_t) + (jsoff_t)idx * sizeof(jsval_t), val);
+    return val;
+}
+
+jsval_t js_arr_push(struct js *js, jsval_t arr, const jsval_t *vals, size_t n)
+{
+    if (vtype(arr) != T_ARR) {
+        return js_mkerr(js, "not an array");
+    }
+    jsoff_t len = arrlen(js, arr);
+    jsval_t res = arrgrow(js, arr, (size_t)len + n);
+    if (is_err(res)) {
+        return res;
+    }
+    jsoff_t dst = arrstor(js, arr) + (jsoff_t)sizeof(jsoff_t) + len * (jsoff_t)sizeof(jsval_t);
+    undolog(js, dst, (jsoff_t)(n * sizeof(jsval_t)));//mark之前的数组可能还有空位
+    memmove(&js->mem[dst], vals, n * sizeof(jsval_t));
+    saveoff(js, (jsoff_t)vdata(arr) + sizeof(jsoff_t), len + (jsoff_t)n);
+    return arr;
+}
+
+/*
+    和Array.prototype.slice一样，[start, end)，超出范围的会被截断。
+*/
+jsval_t js_arr_slice(struct js *js, jsval_t arr, size_t start, size_t end)
+{
+    if (vtype(arr) != T_ARR) {
+        return js_mkerr(js, "not an array");
+    }
+    jsoff_t len = arrlen(js, arr);
+    if (end > len) {
+        end = len;
+    }
+    if (start > end) {
+        start = end;
+    }
+    jsoff_t n = (jsoff_t)(end - start);
+    jsval_t res = mkarr(js, n);
+    if (is_err(res)) {
+        return res;
+    }
+    memcpy(&js->mem[arrstor(js, res) + sizeof(jsoff_t)],
+        &js->mem[arrstor(js, arr) + sizeof(jsoff_t) + (jsoff_t)start * sizeof(jsval_t)],
+        n * sizeof(jsval_t));
+    saveoff(js, (jsoff_t)vdata(res) + sizeof(jsoff_t), n);
+    return res;
+}
+
+static jsval_t upper(struct js *js, jsval_t scope)
+{
+    return mkval(T_OBJ, 
+        loadoff(js, (jsoff_t)(vdata(scope) + sizeof(jsoff_t))) & ~3U
     );
 }
-//表达式只有赋值表达式
-static jsval_t js_expr(strut js *js)
+static void mkscope(struct js *js)
+{
+    assert((js->flags & F_NOEXEC) == 0);//那就要确保要exe
+    jsoff_t prev = (jsoff_t)vdata(js->scope);
+    js->scope = mkobj(js, prev);
+}
+
+static void delscope(struct js *js)
+{
+    js->scope = upper(js, js->scope);
+}
+
+/*
+    函数是代码字符串，不会捕获scope，scope里面的prop也只会在调用期间被引用，
+    所以调用返回的时候scope对象、prop和它们的key可以马上还给free list。
+    返回值要先解析，不能是指向这个scope的prop。
+*/
+static void freescope(struct js *js, jsval_t scope)
+{
+    jsoff_t off = (jsoff_t)vdata(scope);
+    jsoff_t prop = loadoff(js, off) & ~3U;
+    while (prop != 0) {
+        jsoff_t next = loadoff(js, prop) & ~3U;
+        jsoff_t koff = loadoff(js, prop + sizeof(koff));
+        js_free(js, koff, esize(loadoff(js, koff)));
+        js_free(js, prop, esize(T_PROP));
+        prop = next;
+    }
+    js_free(js, off, esize(T_OBJ));
+}
+
+static jsval_t js_expr(struct js *js);
+static bool jit_call(struct js *js, jsval_t func, const jsval_t *args, int nargs, jsval_t *res);
+static jsval_t evalbuf(struct js *js, const char *buf, jsoff_t len, uint8_t flags);
+
+/*
+    参数已经在调用方的scope里面算好了，这里只是建scope、绑定参数名和执行函数体。
+*/
+static jsval_t call_js(struct js *js, const char *fn, jsoff_t fnlen, const jsval_t *args, int nargs)
+{
+    jsoff_t fnpos = 1;
+    int argi = 0;
+    if (js->nrun > 0 && cstack_over(js)) {
+        return js_mkerr(js, "C stack");
+    }
+    mkscope(js);//创建函数调用scope
+    while (fnpos < fnlen) {
+        fnpos = skiptonext(fn, fnlen, fnpos);
+        if (fnpos < fnlen && fn[fnpos] == ')') {
+            break;
+        }
+        jsoff_t identlen = 0;
+        uint8_t tok = parseident(&fn[fnpos], fnlen-fnpos, &identlen);
+        if (tok != TOK_IDENTIFIER) {
+            break;
+        }
+        jsval_t v = argi < nargs ? resolveprop(js, args[argi]) : js_mkundef();
+        argi++;
+        setprop(js, js->scope, js_mkstr(js, &fn[fnpos], identlen), v);
+        fnpos = skiptonext(fn, fnlen, fnpos + identlen);
+        if (fnpos < fnlen && fn[fnpos] == ',') {
+            fnpos++;
+        }
+    }
+    if (fnpos < fnlen && fn[fnpos] == ')') {
+        fnpos++;
+    }
+    fnpos = skiptonext(fn, fnlen, fnpos);
+    if (fnpos < fnlen && fn[fnpos] == '{') {
+        fnpos++;
+    }
+    //函数体去掉最后的'}'
+    jsval_t res = evalbuf(js, &fn[fnpos], fnlen - fnpos - 1U, F_CALL);//重新执行的状态要保留，不能用js_eval
+    if (!is_err(res) && !(js->flags & F_RETURN)) {
+        res = js_mkundef();
+    }
+    res = resolveprop(js, res);
+    jsval_t scope = js->scope;
+    delscope(js);
+    freescope(js, scope);
+    return res;
+}
+
+/*
+    在调用方的scope里面从左往右计算参数，放在arena的最顶上（js->size往下长），
+    最后倒一下顺序，js->mem[js->size]开始就是args[0]。
+    调用完由调用方把js->size加回去，出错的时候这里自己还回去。
+*/
+static jsval_t pushargs(struct js *js, int *argc)
+{
+    *argc = 0;
+    while (js->pos < js->clen) {
+        if (next(js) == TOK_RPAREN) {
+            break;
+        }
+        jsval_t arg = resolveprop(js, js_expr(js));
+        if (is_err(arg)) {
+            js->size += (jsoff_t)(sizeof(arg) * (size_t)*argc);
+            return arg;
+        }
+        if (js->brk + sizeof(arg) > js->size) {
+            js->size += (jsoff_t)(sizeof(arg) * (size_t)*argc);
+            return js_mkerr(js, "call oom");
+        }
+        js->size -= (jsoff_t)sizeof(arg);
+        if (js->size < js->argmin) {
+            js->argmin = js->size;
+        }
+        saveval(js, js->size, arg);
+        (*argc)++;
+        if (next(js) == TOK_COMMA) {
+            js->consumed = 1;
+        }
+    }
+    jsval_t *args = (jsval_t *)&js->mem[js->size];
+    for (int i = 0; i < *argc / 2; i++) {
+        jsval_t tmp = args[i];
+        args[i] = args[*argc - 1 - i];
+        args[*argc - 1 - i] = tmp;
+    }
+    return js_mkundef();
+}
+
+static jsval_t call_c(struct js *js, jsval_t (*fn)(struct js *, jsval_t *, int), jsval_t *args, int argc)
+{
+    jsval_t res;
+    if (js->susp == S_REPLAY) {
+        //已经完成的调用不再调宿主函数，直接返回记下来的结果
+        res = js->slog[js->ilog++];
+        if (js->ilog == js->nlog) {
+            js->susp = S_NONE;
+        }
+    } else {
+        res = fn(js, args, argc);
+        if (js->susp != S_WAIT && js->nlog < JS_MAXLOG) {
+            js->slog[js->nlog++] = res;
+        }
+    }
+    return res;
+}
+
+static jsval_t do_call_op(struct js *js, jsval_t func, jsval_t args)
+{
+    if (vtype(args) != T_CODEREF) {
+        return js_mkerr(js, "bad call");
+    }
+    if (vtype(func) != T_FUNC && vtype(func) != T_CFUNC) {
+        return js_mkerr(js, "calling non-function");
+    }
+    const char *code = js->code;
+    jsoff_t clen = js->clen;
+    jsoff_t pos = js->pos;
+    js->code = &js->code[coderefoff(args)];
+    js->clen = codereflen(args);
+    js->pos = skiptonext(js->code, js->clen, 0);//调到第一个参数上
+    uint8_t tok = js->tok;
+    uint8_t flags = js->flags;//保存flags
+    jsoff_t nogc = js->nogc;
+    int argc = 0;
+    jsval_t res = pushargs(js, &argc);
+    if (!is_err(res)) {
+        jsval_t *argv = (jsval_t *)&js->mem[js->size];
+        if (vtype(func) == T_FUNC) {
+            jsoff_t fnlen = 0;
+            const char *fn = vstr(js, func, &fnlen);//拿到函数名字
+            js->nogc = (jsoff_t)vdata(func);//标记这个内容不要被gc回收。
+            js->seff = true;//不知道函数里面有没有副作用，都算
+            if (!jit_call(js, func, argv, argc, &res)) {
+                res = call_js(js, fn, fnlen, argv, argc);
+            }
+        } else {
+            res = call_c(js, (jsval_t (*)(struct js*, jsval_t*, int))vdata(func), argv, argc);
+        }
+        js->size += (jsoff_t)(sizeof(jsval_t) * (size_t)argc);
+    }
+    js->code = code;
+    js->clen = clen;
+    js->pos = pos;
+    js->flags = flags;
+    js->tok = tok;
+    js->nogc = nogc;
+    js->consumed = 1;
+    return res;
+}
+
+/*
+    宿主调用js函数或者C函数，参数直接给值，和脚本里面的调用一样都不从代码里面解析参数。
+    解析的状态先存起来，调用完恢复，所以宿主函数里面也可以调。
+*/
+jsval_t js_call(struct js *js, jsval_t func, const jsval_t *args, int nargs)
+{
+    if (nargs < 0 || (nargs > 0 && args == NULL)) {
+        return js_mkerr(js, "bad args");
+    }
+    if (vtype(func) != T_FUNC && vtype(func) != T_CFUNC) {
+        return js_mkerr(js, "calling non-function");
+    }
+    const char *code = js->code;
+    jsoff_t clen = js->clen, pos = js->pos, toff = js->toff, tlen = js->tlen, nogc = js->nogc;
+    uint8_t tok = js->tok, consumed = js->consumed, flags = js->flags;
+    bool seff = js->seff;//宿主函数里面调的js不会重新执行，不算脚本的副作用
+    jsval_t res;
+    if (vtype(func) == T_FUNC) {
+        jsoff_t fnlen = 0;
+        const char *fn = vstr(js, func, &fnlen);
+        js->nogc = (jsoff_t)vdata(func);
+        js->flags = 0;
+        if (!jit_call(js, func, args, nargs, &res)) {
+            res = call_js(js, fn, fnlen, args, nargs);
+        }
+    } else {
+        res = ((jsval_t (*)(struct js *, jsval_t *, int))vdata(func))(js, (jsval_t *)args, nargs);
+    }
+    js->code = code;
+    js->clen = clen;
+    js->pos = pos;
+    js->toff = toff;
+    js->tlen = tlen;
+    js->nogc = nogc;
+    js->tok = tok;
+    js->consumed = consumed;
+    js->flags = flags;
+    js->seff = seff;
+    return res;
+}
+/*
+    拼接的结果总是在arena里面新分配，外部字符串在这里才被拷贝进arena。
+*/
+static jsval_t strconcat(struct js *js, jsval_t l, jsval_t r)
+{
+    jsoff_t n1 = 0, n2 = 0;
+    const char *p1 = vstr(js, l, &n1);
+    const char *p2 = vstr(js, r, &n2);
+    jsval_t res = js_mkstr(js, NULL, (size_t)n1 + n2);
+    if (is_err(res)) {
+        return res;
+    }
+    jsoff_t off = (jsoff_t)vdata(res) + sizeof(jsoff_t);
+    memmove(&js->mem[off], p1, n1);
+    memmove(&js->mem[off + n1], p2, n2);
+    return res;
+}
+
+/*
+    二元运算的kernel，调用的时候两个操作数已经解析好了，类型也确定了，
+    不再做任何检查。
+*/
+typedef jsval_t (*jskernel_t)(struct js *, jsval_t, jsval_t);
+
+#define NUMKERNEL(_name, _expr) \
+    static jsval_t _name(struct js *js, jsval_t l, jsval_t r) \
+    { \
+        double a = tod(l), b = tod(r); \
+        (void)js; \
+        return _expr; \
+    }
+NUMKERNEL(k_exp, mknum(pow(a, b)))
+NUMKERNEL(k_mul, mknum(a * b))
+NUMKERNEL(k_div, mknum(a / b))
+NUMKERNEL(k_rem, mknum(fmod(a, b)))
+NUMKERNEL(k_add, mknum(a + b))
+NUMKERNEL(k_sub, mknum(a - b))
+NUMKERNEL(k_shl, tov((int32_t)(touint32(a) << (touint32(b) & 31))))
+NUMKERNEL(k_shr, tov((int32_t)touint32(a) >> (touint32(b) & 31)))
+NUMKERNEL(k_zshr, tov(touint32(a) >> (touint32(b) & 31)))
+NUMKERNEL(k_lt, mkval(T_BOOL, a < b))
+NUMKERNEL(k_le, mkval(T_BOOL, a <= b))
+NUMKERNEL(k_gt, mkval(T_BOOL, a > b))
+NUMKERNEL(k_ge, mkval(T_BOOL, a >= b))
+NUMKERNEL(k_eq, mkval(T_BOOL, a == b))
+NUMKERNEL(k_ne, mkval(T_BOOL, a != b))
+NUMKERNEL(k_and, tov((int32_t)(touint32(a) & touint32(b))))
+NUMKERNEL(k_xor, tov((int32_t)(touint32(a) ^ touint32(b))))
+NUMKERNEL(k_or, tov((int32_t)(touint32(a) | touint32(b))))
+
+//按TOK_EXP到TOK_OR的顺序
+static const jskernel_t numkernels[] = {
+    k_exp, k_mul, k_div, k_rem, k_add, k_sub, k_shl, k_shr, k_zshr,
+    k_lt, k_le, k_gt, k_ge, k_eq, k_ne, k_and, k_xor, k_or
+};
+
+static jsval_t k_streq(struct js *js, jsval_t l, jsval_t r)
+{
+    jsoff_t n1 = 0, n2 = 0;
+    const char *p1 = vstr(js, l, &n1);
+    const char *p2 = vstr(js, r, &n2);
+    return mkval(T_BOOL, streq(p1, n1, p2, n2));
+}
+
+static jsval_t k_strne(struct js *js, jsval_t l, jsval_t r)
+{
+    return mkval(T_BOOL, !vdata(k_streq(js, l, r)));
+}
+
+enum { K_NONE, K_NUMNUM, K_STRSTR };
+
+static uint8_t opkind(jsval_t l, jsval_t r)
+{
+    if (vtype(l) == T_NUM && vtype(r) == T_NUM) {
+        return K_NUMNUM;
+    }
+    if (vtype(l) == T_STR && vtype(r) == T_STR) {
+        return K_STRSTR;
+    }
+    return K_NONE;
+}
+
+static jskernel_t kernelfor(uint8_t op, uint8_t kind)
+{
+    if (kind == K_NUMNUM && op >= TOK_EXP && op <= TOK_OR) {
+        return numkernels[op - TOK_EXP];
+    }
+    if (kind == K_STRSTR) {
+        switch (op) {
+            case TOK_PLUS: return strconcat;
+            case TOK_EQ: return k_streq;
+            case TOK_NE: return k_strne;
+            default: break;
+        }
+    }
+    return NULL;
+}
+
+static jsval_t do_op(struct js* js, uint8_t op, jsval_t lhs, jsval_t rhs)
+{
+    if (js->flags & F_NOEXEC) {
+        return 0;//返回0意义是什么？
+    }
+    jsval_t l = resolveprop(js, lhs);
+    jsval_t r = resolveprop(js, rhs);
+    // setlwm(js); TODO
+    if (is_err(l)) {
+        return l;
+    }
+    if (is_err(r)) {
+        return r;
+    }
+    if (is_assign(op) && vtype(lhs) != T_PROP) {
+        return js_mkerr(js, "bad lhs");
+    }
+    switch (op) {
+        // typeof是运算符号，所以可以不加括号的, typeof a这样。
+        case TOK_TYPEOF:
+            return js_mkstr(js, typestr(vtype(r)), strlen(typestr(vtype(r))));
+        case TOK_CALL:
+            return do_call_op(js, l, r);
+        default:
+            break;
+    }
+    jskernel_t kernel = kernelfor(op, opkind(l, r));
+    if (kernel != NULL) {
+        return kernel(js, l, r);
+    }
+    if (op == TOK_EQ || op == TOK_NE) {
+        return mkval(T_BOOL, (l == r) == (op == TOK_EQ));//类型不同或者不是数字字符串，比较是不是同一个值
+    }
+    return js_mkerr(js, "bad operands");
+}
+
+/*
+    quickening：每个二元运算符出现的位置（site）记录最近见到的操作数类型，
+    连续QUICKEN_AFTER次都一样，就把site改写成对应的kernel，
+    之后只比较一下类型就直接调用kernel，跳过do_op里面的解析、检查和分发。
+    类型变了就退回do_op，重新统计。
+    site表是arena里面的一个blob，按代码位置hash，冲突了就覆盖。
+*/
+#define JS_NSITES 32
+#define QUICKEN_AFTER 2
+
+struct jssite {
+    const char *pc;//运算符在代码里面的位置
+    jskernel_t kernel;//NULL表示还没有quicken
+    uint8_t op;
+    uint8_t kind;
+    uint8_t streak;//连续见到kind的次数
+    uint32_t hits;//走kernel的次数
+    uint32_t deopts;//类型变了退回通用路径的次数
+};
+
+static jsoff_t sitetab(struct js *js)
+{
+    if (js->sites == 0) {
+        js->sites = mkblob(js, NULL, JS_NSITES * sizeof(struct jssite));
+        if (js->sites != ~0U) {
+            memset(&js->mem[js->sites + sizeof(jsoff_t)], 0, JS_NSITES * sizeof(struct jssite));
+        }
+    }
+    return js->sites;
+}
+
+static jsval_t do_binop(struct js *js, uint8_t op, const char *pc, jsval_t lhs, jsval_t rhs)
+{
+    struct jssite site;
+    jsoff_t tab = 0;
+    if ((js->flags & F_NOEXEC) || is_assign(op) || (tab = sitetab(js)) == ~0U) {
+        return do_op(js, op, lhs, rhs);
+    }
+    jsoff_t off = tab + sizeof(jsoff_t) +
+        (jsoff_t)(((uintptr_t)pc >> 1) % JS_NSITES) * sizeof(site);
+    memcpy(&site, &js->mem[off], sizeof(site));
+    if (site.pc != pc || site.op != op) {
+        memset(&site, 0, sizeof(site));
+        site.pc = pc;
+        site.op = op;
+    }
+    //变量存的值都已经解析过了，所以prop只需要取一层
+    jsval_t l = vtype(lhs) == T_PROP ? loadval(js, (jsoff_t)vdata(lhs) + sizeof(jsoff_t) * 2) : lhs;
+    jsval_t r = vtype(rhs) == T_PROP ? loadval(js, (jsoff_t)vdata(rhs) + sizeof(jsoff_t) * 2) : rhs;
+    uint8_t kind = opkind(l, r);
+    jsval_t res;
+    if (site.kernel != NULL && kind == site.kind) {
+        site.hits++;
+        res = site.kernel(js, l, r);
+    } else {
+        if (site.kernel != NULL) {
+            site.kernel = NULL;
+            site.deopts++;
+        }
+        site.streak = (uint8_t)(kind == site.kind && site.streak < 255 ? site.streak + 1 : 1);
+        site.kind = kind;
+        if (site.streak >= QUICKEN_AFTER) {
+            site.kernel = kernelfor(op, kind);
+        }
+        res = do_op(js, op, lhs, rhs);
+    }
+    memcpy(&js->mem[off], &site, sizeof(site));
+    return res;
+}
+
+static const char *kindstr(uint8_t kind)
+{
+    return kind == K_NUMNUM ? "num*num" : kind == K_STRSTR ? "str*str" : "generic";
+}
+
+/*
+    打印每个site的quicken情况。
+*/
+void js_dump_sites(struct js *js)
+{
+    struct jssite site;
+    if (js->sites == 0 || js->sites == ~0U) {
+        return;
+    }
+    for (jsoff_t i = 0; i < JS_NSITES; i++) {
+        memcpy(&site, &js->mem[js->sites + sizeof(jsoff_t) + i * sizeof(site)], sizeof(site));
+        if (site.pc == NULL) {
+            continue;
+        }
+        printf("site %p op %u %s %s hits %u deopts %u\n", (void *)site.pc, site.op,
+            kindstr(site.kind), site.kernel != NULL ? "quickened" : "generic",
+            (unsigned)site.hits, (unsigned)site.deopts);
+    }
+}
+static jsval_t js_break(struct js *js)
+{
+    if (js->flags & F_NOEXEC) {
+        //
+    } else {
+        if (!(js->flags & F_LOOP)) {
+            return js_mkerr(js, "not in loop");
+        }
+        js->flags |= F_BREAK | F_NOEXEC;
+    }
+    js->consumed = 1;
+    return js_mkundef();
+}
+/*
+    return只能在函数体里面用。设上F_RETURN以后js_run不再往下执行，
+    call_js看到F_RETURN就用这个语句的值做返回值。
+*/
+static jsval_t js_return(struct js *js)
+{
+    uint8_t exe = !(js->flags & F_NOEXEC);
+    jsval_t res = js_mkundef();
+    js->consumed = 1;
+    if (exe && !(js->flags & F_CALL)) {
+        return js_mkerr(js, "not in function");
+    }
+    uint8_t tok = next(js);
+    if (tok != TOK_SEMICOLON && tok != TOK_EOF && tok != TOK_RBRACE) {
+        res = resolveprop(js, js_expr(js));
+    }
+    if (exe && !is_err(res)) {
+        js->flags |= F_RETURN;
+    }
+    return res;
+}
+static bool js_truthy(struct js *js, jsval_t v)
+{
+    jsoff_t len = 0;
+    switch (vtype(v)) {
+        case T_BOOL:
+            return vdata(v) != 0;
+        case T_NUM:
+            return tod(v) != 0 && !isnan(tod(v));
+        case T_STR:
+            vstr(js, v, &len);
+            return len > 0;
+        case T_UNDEF:
+        case T_NULL:
+        case T_ERR:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static double tonum(struct js *js, jsval_t v)
+{
+    jsoff_t len = 0, n = 0, i = 0;
+    const char *p;
+    switch (vtype(v)) {
+        case T_NUM:
+            return tod(v);
+        case T_BOOL:
+            return vdata(v) ? 1 : 0;
+        case T_NULL:
+            return 0;
+        case T_STR:
+            p = vstr(js, v, &len);
+            i = skiptonext(p, len, 0);
+            if (i == len) {
+                return 0;//空字符串是0
+            }
+            if (is_digit(p[i]) || p[i] == '.') {
+                double d = parsenum(&p[i], len - i, &n);
+                return skiptonext(p, len, i + n) == len ? d : NAN;
+            }
+            return NAN;
+        default:
+            return NAN;
+    }
+}
+
+/*
+    从pos的开括号开始，跳到配对的闭括号后面，字符串和注释里面的括号不算。
+    找不到配对的返回clen。
+*/
+static jsoff_t skipblock(const char *code, jsoff_t clen, jsoff_t pos)
+{
+    int depth = 0;
+    while (pos < clen) {
+        jsoff_t n = skiptonext(code, clen, pos);
+        if (n != pos) {
+            pos = n;
+            continue;
+        }
+        char c = code[pos];
+        if (c == '"' || c == '\'') {
+            for (pos++; pos < clen && code[pos] != c; pos++) {
+                if (code[pos] == '\\') {
+                    pos++;
+                }
+            }
+        } else if (c == '(' || c == '{' || c == '[') {
+            depth++;
+        } else if (c == ')' || c == '}' || c == ']') {
+            if (--depth == 0) {
+                return pos + 1;
+            }
+        }
+        pos++;
+    }
+    return clen;
+}
+
+//字符串字面量，去掉引号，处理转义
+static jsval_t js_strlit(struct js *js)
+{
+    const char *p = &js->code[js->toff + 1];
+    jsoff_t n = js->tlen - 2, len = 0;
+    for (jsoff_t i = 0; i < n; i++, len++) {
+        if (p[i] == '\\') {
+            i += p[i + 1] == 'x' ? 3 : 1;
+        }
+    }
+    jsval_t res = js_mkstr(js, NULL, len);
+    if (is_err(res)) {
+        return res;
+    }
+    char *out = (char *)&js->mem[(jsoff_t)vdata(res) + sizeof(jsoff_t)];
+    for (jsoff_t i = 0; i < n; i++) {
+        char c = p[i];
+        if (c == '\\') {
+            c = p[++i];
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'v': c = '\v'; break;
+                case '0': c = '\0'; break;
+                case 'x':
+                    c = (char)(unhex(p[i + 1]) << 4 | unhex(p[i + 2]));
+                    i += 2;
+                    break;
+                default:
+                    break;
+            }
+        }
+        *out++ = c;
+    }
+    return res;
+}
+
+//从当前scope往外找变量
+static jsval_t lookupvar(struct js *js, const char *name, size_t len)
+{
+    for (jsval_t scope = js->scope;; scope = upper(js, scope)) {
+        jsval_t prop = lookup(js, scope, name, len);
+        if (vtype(prop) != T_UNDEF) {
+            return prop;
+        }
+        if (vdata(scope) == 0) {
+            break;//全局scope
+        }
+    }
+    return js_mkerr(js, "'%.*s' not found", (int)len, name);
+}
+
+/*
+    function(a, b) { ... }，函数的值就是从左括号到右大括号的代码，
+    调用的时候由call_js解析参数和函数体。
+*/
+static jsval_t js_func(struct js *js)
+{
+    jsoff_t pos = skiptonext(js->code, js->clen, js->pos);
+    if (pos >= js->clen || js->code[pos] != '(') {
+        return js_mkerr(js, "parse error");
+    }
+    jsoff_t body = skiptonext(js->code, js->clen, skipblock(js->code, js->clen, pos));
+    if (body >= js->clen || js->code[body] != '{') {
+        return js_mkerr(js, "parse error");
+    }
+    jsoff_t end = skipblock(js->code, js->clen, body);
+    if (js->code[end - 1] != '}') {
+        return js_mkerr(js, "parse error");
+    }
+    js->pos = end;
+    js->consumed = 1;
+    if (js->flags & F_NOEXEC) {
+        return js_mkundef();
+    }
+    jsval_t str = js_mkstr(js, &js->code[pos], end - pos);
+    return is_err(str) ? str : mkval(T_FUNC, vdata(str));
+}
+
+static jsval_t js_primary(struct js *js)
+{
+    bool exe = !(js->flags & F_NOEXEC);
+    jsval_t res;
+    switch (next(js)) {
+        case TOK_NUMBER:
+            res = js->tval;
+            break;
+        case TOK_STRING:
+            res = exe ? js_strlit(js) : js_mkundef();
+            break;
+        case TOK_TRUE:
+            res = js_mktrue();
+            break;
+        case TOK_FALSE:
+            res = js_mkfalse();
+            break;
+        case TOK_NULL:
+            res = js_mknull();
+            break;
+        case TOK_UNDEF:
+            res = js_mkundef();
+            break;
+        case TOK_IDENTIFIER:
+            res = exe ? lookupvar(js, &js->code[js->toff], js->tlen) : js_mkundef();
+            break;
+        case TOK_FUNC:
+            return js_func(js);
+        default:
+            return js_mkerr(js, "parse error");
+    }
+    if (!is_err(res)) {
+        js->consumed = 1;
+    }
+    return res;
+}
+
+//o.key，key不存在的时候如果后面是赋值，先创建出来
+static jsval_t do_dot_op(struct js *js, jsval_t obj)
+{
+    if (next(js) != TOK_IDENTIFIER) {
+        return js_mkerr(js, "parse error");
+    }
+    const char *name = &js->code[js->toff];
+    jsoff_t len = js->tlen;
+    js->consumed = 1;
+    if (js->flags & F_NOEXEC) {
+        return js_mkundef();
+    }
+    obj = resolveprop(js, obj);
+    if ((vtype(obj) == T_ARR || vtype(obj) == T_VIEW) && streq(name, len, "length", 6)) {
+        return tov((double)js_arr_len(js, obj));
+    }
+    if (vtype(obj) != T_OBJ) {
+        return js_mkerr(js, "lookup in non-obj");
+    }
+    jsval_t prop = lookup(js, obj, name, len);
+    if (vtype(prop) == T_UNDEF && next(js) == TOK_ASSIGN) {
+        jsval_t k = js_mkstr(js, name, len);
+        prop = is_err(k) ? k : setprop(js, obj, k, js_mkundef());
+    }
+    return prop;
+}
+
+//f(...)，参数的代码交给do_call_op去执行
+static jsval_t do_call(struct js *js, jsval_t func)
+{
+    jsoff_t start = js->toff + 1;
+    jsoff_t end = skipblock(js->code, js->clen, js->toff);
+    if (js->code[end - 1] != ')') {
+        return js_mkerr(js, "parse error");
+    }
+    js->pos = end;
+    js->consumed = 1;
+    if (js->flags & F_NOEXEC) {
+        return js_mkundef();
+    }
+    return do_op(js, TOK_CALL, func, mkcoderef(start, end - start));
+}
+
+//++和--，前缀返回新的值，后缀返回旧的值
+static jsval_t do_incdec(struct js *js, uint8_t op, jsval_t lhs, bool post)
+{
+    if (js->flags & F_NOEXEC) {
+        return js_mkundef();
+    }
+    if (vtype(lhs) != T_PROP) {
+        return js_mkerr(js, "bad lhs");
+    }
+    double old = tonum(js, resolveprop(js, lhs));
+    jsval_t v = mknum(op == TOK_POSTINC ? old + 1 : old - 1);
+    js->seff = true;
+    saveval(js, (jsoff_t)vdata(lhs) + sizeof(jsoff_t) * 2, v);
+    return post ? mknum(old) : v;
+}
+
+static jsval_t do_unary(struct js *js, uint8_t op, jsval_t v)
+{
+    if (js->flags & F_NOEXEC) {
+        return js_mkundef();
+    }
+    switch (op) {
+        case TOK_NOT:
+            return mkval(T_BOOL, !js_truthy(js, resolveprop(js, v)));
+        case TOK_TILDA:
+            return tov((int32_t)~touint32(tonum(js, resolveprop(js, v))));
+        case TOK_UMINUS:
+            return mknum(-tonum(js, resolveprop(js, v)));
+        case TOK_UPLUS:
+            return mknum(tonum(js, resolveprop(js, v)));
+        case TOK_POSTINC:
+        case TOK_POSTDEC:
+            return do_incdec(js, op, v, false);
+        default:
+            return do_op(js, op, js_mkundef(), v);
+    }
+}
+
+//按TOK_PLUS_ASSIGN到TOK_OR_ASSIGN的顺序
+static const uint8_t assignop[] = {
+    TOK_PLUS, TOK_MINUS, TOK_MUL, TOK_DIV, TOK_REM, TOK_SHL, TOK_SHR, TOK_ZSHR,
+    TOK_AND, TOK_XOR, TOK_OR
+};
+
+static jsval_t do_assign(struct js *js, uint8_t op, const char *pc, jsval_t lhs, jsval_t rhs)
+{
+    if (js->flags & F_NOEXEC) {
+        return js_mkundef();
+    }
+    if (vtype(lhs) != T_PROP) {
+        return js_mkerr(js, "bad lhs");
+    }
+    jsval_t v = resolveprop(js, rhs);
+    if (op != TOK_ASSIGN) {
+        v = do_binop(js, assignop[op - TOK_PLUS_ASSIGN], pc, lhs, v);
+    }
+    if (!is_err(v)) {
+        saveval(js, (jsoff_t)vdata(lhs) + sizeof(jsoff_t) * 2, v);
+        js->seff = true;
+    }
+    return v;
+}
+
+/*
+    表达式用优先级爬升来求值，操作数和运算符各放在一个显式的栈上，
+    不再是每个优先级一层函数调用，一个字面量只要调一次js_primary。
+    遇到二元运算符时，先把栈顶优先级更高（左结合的时候相等也算）的运算符算掉，再压栈。
+    栈的深度只和括号、前缀运算符、右结合这些真正的嵌套有关，超过EXPR_MAXDEPTH报错。
+    && || ?: 压栈的时候记下flags，不需要执行的一边设上F_NOEXEC，算完以后恢复。
+*/
+#define EXPR_MAXDEPTH 64
+#define PREC_UNARY 14
+
+//二元运算符的优先级，0表示不是二元运算符，按TOK_EXP到TOK_OR_ASSIGN的顺序
+static const uint8_t binprec[] = {
+    13,             // **
+    12, 12, 12,     // * / %
+    11, 11,         // + -
+    10, 10, 10,     // << >> >>>
+    9, 9, 9, 9,     // < <= > >=
+    8, 8,           // == !=
+    7, 6, 5,        // & ^ |
+    4, 3,           // && ||
+    0, 2,           // : ?
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 // = += -= *= /= %= <<= >>= >>>= &= ^= |=
+};
+
+static uint8_t precof(uint8_t tok)
+{
+    return tok >= TOK_EXP && tok <= TOK_OR_ASSIGN ? binprec[tok - TOK_EXP] : 0;
+}
+
+static bool is_rassoc(uint8_t tok)
+{
+    return tok == TOK_EXP || tok == TOK_Q || is_assign(tok);
+}
+
+struct exop {
+    const char *pc;//运算符在代码里面的位置，site表用
+    uint8_t op;
+    uint8_t prec;//左括号是0
+    uint8_t flags;//&& || ?: 压栈前的flags
+};
+
+struct expr {
+    jsval_t vals[EXPR_MAXDEPTH];
+    struct exop ops[EXPR_MAXDEPTH];
+    int nv;
+    int no;
+};
+
+//算掉栈顶的运算符，结果放在操作数栈顶
+static jsval_t reduce(struct js *js, struct expr *e)
+{
+    struct exop o = e->ops[--e->no];
+    jsval_t *top = &e->vals[e->nv - 1], res;
+    if (o.prec == PREC_UNARY) {
+        return *top = do_unary(js, o.op, *top);
+    }
+    jsval_t r = e->vals[--e->nv];
+    top = &e->vals[e->nv - 1];
+    switch (o.op) {
+        case TOK_LAND:
+        case TOK_LOR:
+            js->flags = o.flags;
+            if (js->flags & F_NOEXEC) {
+                res = js_mkundef();
+            } else {
+                jsval_t l = resolveprop(js, *top);
+                res = js_truthy(js, l) == (o.op == TOK_LAND) ? resolveprop(js, r) : l;
+            }
+            break;
+        case TOK_COLON:
+            //栈上是 条件 真的值 假的值
+            js->flags = o.flags;
+            jsval_t a = e->vals[--e->nv];
+            top = &e->vals[e->nv - 1];
+            res = (js->flags & F_NOEXEC) ? js_mkundef() :
+                js_truthy(js, resolveprop(js, *top)) ? resolveprop(js, a) : resolveprop(js, r);
+            break;
+        case TOK_Q:
+            return js_mkerr(js, "parse error");
+        default:
+            res = is_assign(o.op) ? do_assign(js, o.op, o.pc, *top, r) :
+                (js->flags & F_NOEXEC) ? js_mkundef() : do_binop(js, o.op, o.pc, *top, r);
+            break;
+    }
+    return *top = res;
+}
+
+static jsval_t pushop(struct js *js, struct expr *e, uint8_t op, uint8_t prec)
+{
+    if (e->no >= EXPR_MAXDEPTH) {
+        return js_mkerr(js, "expr too deep");
+    }
+    struct exop *o = &e->ops[e->no++];
+    o->pc = &js->code[js->toff];
+    o->op = op;
+    o->prec = prec;
+    o->flags = js->flags;
+    js->consumed = 1;
+    return js_mkundef();
+}
+
+//最近的左括号以内有没有op，用来判断)和:是不是属于这个表达式
+static bool has_open(struct expr *e, uint8_t op)
+{
+    for (int i = e->no - 1; i >= 0; i--) {
+        if (e->ops[i].op == op) {
+            return true;
+        }
+        if (e->ops[i].prec == 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+static jsval_t expr_loop(struct js *js)
+{
+    struct expr e;
+    jsval_t res;
+    e.nv = e.no = 0;
+    if (js->nrun > 0 && cstack_over(js)) {
+        return js_mkerr(js, "C stack");
+    }
+    for (;;) {
+        //前缀运算符和左括号
+        uint8_t tok = next(js);
+        if (tok == TOK_LPAREN || tok == TOK_NOT || tok == TOK_TILDA || tok == TOK_TYPEOF ||
+            tok == TOK_MINUS || tok == TOK_PLUS || tok == TOK_POSTINC || tok == TOK_POSTDEC) {
+            tok = tok == TOK_MINUS ? TOK_UMINUS : tok == TOK_PLUS ? TOK_UPLUS : tok;
+            if (is_err(res = pushop(js, &e, tok, tok == TOK_LPAREN ? 0 : PREC_UNARY))) {
+                return res;
+            }
+            continue;
+        }
+        if (e.nv >= EXPR_MAXDEPTH) {
+            return js_mkerr(js, "expr too deep");
+        }
+        if (is_err(res = js_primary(js))) {
+            return res;
+        }
+        e.vals[e.nv++] = res;
+        //后缀：调用、成员、++ --、右括号
+        for (;;) {
+            tok = next(js);
+            jsval_t *top = &e.vals[e.nv - 1];
+            if (tok == TOK_LPAREN) {
+                res = *top = do_call(js, *top);
+            } else if (tok == TOK_DOT) {
+                js->consumed = 1;
+                res = *top = do_dot_op(js, *top);
+            } else if (tok == TOK_POSTINC || tok == TOK_POSTDEC) {
+                js->consumed = 1;
+                res = *top = do_incdec(js, tok, *top, true);
+            } else if (tok == TOK_RPAREN && has_open(&e, TOK_LPAREN)) {
+                while (e.ops[e.no - 1].prec != 0) {
+                    if (is_err(res = reduce(js, &e))) {
+                        return res;
+                    }
+                }
+                e.no--;
+                js->consumed = 1;
+            } else {
+                break;
+            }
+            if (is_err(res)) {
+                return res;
+            }
+        }
+        //二元运算符
+        uint8_t prec = precof(tok);
+        if (tok == TOK_COLON && has_open(&e, TOK_Q)) {
+            while (e.ops[e.no - 1].op != TOK_Q) {
+                if (is_err(res = reduce(js, &e))) {
+                    return res;
+                }
+            }
+            struct exop *q = &e.ops[e.no - 1];
+            js->flags = q->flags;
+            if (!(js->flags & F_NOEXEC) && js_truthy(js, resolveprop(js, e.vals[e.nv - 2]))) {
+                js->flags |= F_NOEXEC;
+            }
+            q->op = TOK_COLON;
+            js->consumed = 1;
+            continue;
+        }
+        if (prec == 0) {
+            break;
+        }
+        while (e.no > 0 && e.ops[e.no - 1].prec != 0 && e.ops[e.no - 1].op != TOK_Q &&
+            (e.ops[e.no - 1].prec > prec || (e.ops[e.no - 1].prec == prec && !is_rassoc(tok)))) {
+            if (is_err(res = reduce(js, &e))) {
+                return res;
+            }
+        }
+        if (is_err(res = pushop(js, &e, tok, prec))) {
+            return res;
+        }
+        if ((tok == TOK_LAND || tok == TOK_LOR || tok == TOK_Q) && !(js->flags & F_NOEXEC)) {
+            bool t = js_truthy(js, resolveprop(js, e.vals[e.nv - 1]));
+            if ((tok == TOK_LOR) == t) {
+                js->flags |= F_NOEXEC;
+            }
+        }
+    }
+    while (e.no > 0) {
+        if (e.ops[e.no - 1].prec == 0 || e.ops[e.no - 1].op == TOK_Q) {
+            return js_mkerr(js, "parse error");
+        }
+        if (is_err(res = reduce(js, &e))) {
+            return res;
+        }
+    }
+    return e.vals[0];
+}
+
+//&& || ?: 会临时设上F_NOEXEC，中途出错直接返回的时候要恢复
+static jsval_t js_expr(struct js *js)
+{
+    uint8_t flags = js->flags;
+    jsval_t res = expr_loop(js);
+    if (is_err(res)) {
+        js->flags = flags;
+    }
+    return res;
+}
+// let a = 1;
+static jsval_t js_let(struct js *js)
+{
+    uint8_t exe = !(js->flags & F_NOEXEC);
+    js->consumed = 1;
+    for (;;) {
+        EXPECT(TOK_IDENTIFIER, );
+        js->consumed = 0;
+        jsoff_t noff = js->toff;//试图取出后面的identifier
+        jsoff_t nlen = js->tlen;//n是指next的意思
+        char *name = (char *)&js->code[noff];//拿到id的name
+        jsval_t v = js_mkundef();
+        js->consumed = 1;
+        //id后面就应该是一个赋值符号。
+        if (next(js) == TOK_ASSIGN) {
+            js->consumed = 1;
+            v = resolveprop(js, js_expr(js));
+            if (is_err(v)) {
+                return v;
+            }
+        }
+        if (exe) {
+            if (vtype(lookup(js, js->scope, name, nlen)) != T_UNDEF) {
+                return js_mkerr(js, "'%.*s' already declared", (int)nlen, name);
+            }
+            jsval_t k = js_mkstr(js, name, nlen);
+            jsval_t x = is_err(k) ? k : setprop(js, js->scope, k, v);
+            if (is_err(x)) {
+                return x;
+            }
+            js->seff = true;
+        }
+        if (next(js) != TOK_COMMA) {
+            break;
+        }
+        js->consumed = 1;
+    }
+    return js_mkundef();
+}
+static jsval_t js_stmt(struct js *js)
+{
+    jsval_t res;
+    if (js->brk > js->gct) {
+        // js_gc(js);
+    }
+    switch(next(js)) {
+        case TOK_CASE:
+        case TOK_CATCH:
+        case TOK_CLASS:
+        case TOK_CONST:
+        case TOK_DEFAULT:
+        case TOK_DELETE:
+        case TOK_DO:
+        case TOK_FINALLY:
+        case TOK_IN:
+        case TOK_INSTANCEOF:
+        case TOK_NEW:
+        case TOK_SWITCH:
+        case TOK_THIS:
+        case TOK_THROW:
+        case TOK_TRY:
+        case TOK_VAR:
+        case TOK_VOID:
+        case TOK_WITH:
+        case TOK_WHILE:
+        case TOK_YIELD:
+            res = js_mkerr(js, "'%.*s not implemented", (int)js->tlen, js->code+js->toff);
+            break;
+        case TOK_CONTINUE:
+            res = js_continue(js);
+            break;
+        case TOK_BREAK:
+            res = js_break(js);
+            break;
+        case TOK_LET:
+            res = js_let(js);
+            break;
+        case TOK_RETURN:
+            res = js_return(js);
+            break;
+        case TOK_SEMICOLON:
+            res = js_mkundef();
+            break;
+        default:
+            res = resolveprop(js, js_expr(js));
+            break;
+    }
+    if (!is_err(res) && next(js) == TOK_SEMICOLON) {
+        js->consumed = 1;
+    }
+    return res;
+}
+
+/*
+    一条一条执行语句，顶层的每条语句开始前清空C调用的记录。
+    宿主函数返回pending以后，记下这条语句的开始位置，退出。
+*/
+static jsval_t js_run(struct js *js)
+{
+    jsval_t res = js_mkundef();
+    if (js->nrun == 0) {
+        js->cstk = &res;//为什么指向这个？因为是C栈的第一个局部变量。嵌套的js_run不能改，不然量不出递归用的栈
+    }
+    js->nrun++;
+    while (next(js) != TOK_EOF && !is_err(res) && !(js->flags & F_RETURN)) {
+        jsoff_t start = js->toff;
+        if (js->susp != S_REPLAY && !(js->flags & F_CALL)) {
+            js->nlog = 0;
+        }
+        if (!(js->flags & F_CALL)) {
+            js->seff = false;
+        }
+        res = js_stmt(js);
+        if (js->susp == S_WAIT) {
+            js->spos = start;
+            break;
+        }
+    }
+    js->nrun--;
+    return res;
+}
+
+//flags从头设置，上一次出错留下的F_NOEXEC不能带过来
+static jsval_t evalbuf(struct js *js, const char *buf, jsoff_t len, uint8_t flags)
+{
+    js->flags = flags;
+    js->consumed = 1;
+    js->tok = TOK_ERR;
+    js->code = buf;
+    js->clen = len;
+    js->pos = 0;
+    return js_run(js);
+}
+
+jsval_t js_eval(struct js *js, const char *buf, size_t len)
+{
+    if (len == (size_t)~0U) {
+        len = strlen(buf);
+    }
+    js->susp = S_NONE;//没有resume的脚本直接丢掉
+    return evalbuf(js, buf, (jsoff_t)len, 0);
+}
+
+/*
+    挂起是靠重新执行实现的：C栈上的状态在返回pending的时候已经退掉了，
+    resume的时候从挂起的那条语句开头重新执行，
+    这条语句里面之前完成的C调用和挂起的那个调用都直接返回记下来的值，不会再调宿主函数。
+    C调用以外的副作用（赋值、let、++、调用js函数）重新执行会再做一遍，
+    所以这条语句里面挂起之前有过这些就不能挂起，js_mkpending返回错误；挂起也不能发生在js函数里面。
+*/
+jsval_t js_mkpending(struct js *js)
+{
+    if (js->flags & F_CALL) {
+        return js_mkerr(js, "suspend in function");
+    }
+    if (js->nlog >= JS_MAXLOG) {
+        return js_mkerr(js, "suspend log full");
+    }
+    if (js->seff) {
+        return js_mkerr(js, "suspend after side effect");
+    }
+    jsval_t res = js_mkerr(js, "pending");
+    js->susp = S_WAIT;
+    return res;
+}
+
+bool js_suspended(struct js *js)
+{
+    return js->susp == S_WAIT;
+}
+
+jsval_t js_resume(struct js *js, jsval_t val)
+{
+    if (js->susp != S_WAIT) {
+        return js_mkerr(js, "not suspended");
+    }
+    js->slog[js->nlog++] = val;
+    js->ilog = 0;
+    js->susp = S_REPLAY;
+    js->flags = 0;
+    js->consumed = 1;
+    js->tok = TOK_ERR;
+    js->pos = js->spos;
+    return js_run(js);
+}
+/*
+    JSON直接解析到js->mem里面，生成T_OBJ/T_PROP/T_STR的entity。
+    一次解析里面相同的key只分配一次，后面的prop都引用同一个key entity。
+*/
+#define JSON_MAXDEPTH 64
+#define JSON_KEYCACHE 64 //必须是2的幂
+
+struct jsonp {
+    struct js *js;
+    const char *buf;
+    jsoff_t len;
+    jsoff_t pos;
+    int depth;
+    jsoff_t keys[JSON_KEYCACHE];//key entity的offset，0表示空位
+};
+
+static jsoff_t json_ws(const char *buf, jsoff_t len, jsoff_t n)
+{
+    while (n < len && (buf[n] == ' ' || buf[n] == '\t' || buf[n] == '\n' || buf[n] == '\r')) {
+        n++;
+    }
+    return n;
+}
+
+static bool json_u4(const char *p, uint32_t *cp)
+{
+    *cp = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!is_xdigit(p[i])) {
+            return false;
+        }
+        *cp = (*cp << 4) | (uint32_t)unhex(p[i]);
+    }
+    return true;
+}
+
+static jsoff_t utf8enc(uint8_t *d, uint32_t c)
+{
+    if (c < 0x80) {
+        d[0] = (uint8_t)c;
+        return 1;
+    } else if (c < 0x800) {
+        d[0] = (uint8_t)(0xc0 | (c >> 6));
+        d[1] = (uint8_t)(0x80 | (c & 0x3f));
+        return 2;
+    } else if (c < 0x10000) {
+        d[0] = (uint8_t)(0xe0 | (c >> 12));
+        d[1] = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
+        d[2] = (uint8_t)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    d[0] = (uint8_t)(0xf0 | (c >> 18));
+    d[1] = (uint8_t)(0x80 | ((c >> 12) & 0x3f));
+    d[2] = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
+    d[3] = (uint8_t)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+/*
+    把带转义的字符串直接解码到dst里面，返回解码后的长度，出错返回~0。
+    解码后的长度不会超过原始长度。
+*/
+static jsoff_t json_unescape(uint8_t *dst, const char *s, jsoff_t n)
+{
+    jsoff_t i = 0, j = 0;
+    while (i < n) {
+        if (s[i] != '\\') {
+            dst[j++] = (uint8_t)s[i++];
+            continue;
+        }
+        if (i + 1 >= n) {
+            return ~0U;
+        }
+        switch (s[i + 1]) {
+            case '"': dst[j++] = '"'; break;
+            case '\\': dst[j++] = '\\'; break;
+            case '/': dst[j++] = '/'; break;
+            case 'b': dst[j++] = '\b'; break;
+            case 'f': dst[j++] = '\f'; break;
+            case 'n': dst[j++] = '\n'; break;
+            case 'r': dst[j++] = '\r'; break;
+            case 't': dst[j++] = '\t'; break;
+            case 'u': {
+                uint32_t c, lo;
+                if (i + 6 > n || !json_u4(&s[i + 2], &c)) {
+                    return ~0U;
+                }
+                i += 4;
+                //代理对，要把两个\u合成一个码点
+                if (c >= 0xd800 && c < 0xdc00 && i + 8 <= n && s[i + 2] == '\\' &&
+                    s[i + 3] == 'u' && json_u4(&s[i + 4], &lo) && lo >= 0xdc00 && lo < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                    i += 6;
+                }
+                j += utf8enc(&dst[j], c);
+                break;
+            }
+            default:
+                return ~0U;
+        }
+        i += 2;
+    }
+    return j;
+}
+
+static jsval_t json_err(struct jsonp *p)
+{
+    return js_mkerr(p->js, "bad json at %u", (unsigned)p->pos);
+}
+
+/*
+    key去重：命中缓存就直接返回已经分配好的key entity。
+*/
+static jsval_t json_key(struct jsonp *p, const char *s, jsoff_t n, uint32_t *slot)
+{
+    struct js *js = p->js;
+    uint32_t i = hashstr(s, n) & (JSON_KEYCACHE - 1);
+    *slot = i;
+    if (p->keys[i] != 0) {
+        jsoff_t off = p->keys[i];
+        jsoff_t klen = offtolen(loadoff(js, off));
+        if (streq(s, n, (const char *)&js->mem[off + sizeof(off)], klen)) {
+            return mkval(T_STR, off);
+        }
+    }
+    return js_mkundef();
+}
+
+static jsval_t json_str(struct jsonp *p, bool iskey)
+{
+    struct js *js = p->js;
+    jsoff_t start = p->pos + 1, i = start;
+    bool esc = false;
+    uint32_t slot = 0;
+    //先找到字符串结束的引号，顺便看看有没有转义
+    while (i < p->len && p->buf[i] != '"') {
+        if ((uint8_t)p->buf[i] < 0x20) {
+            p->pos = i;
+            return json_err(p);
+        }
+        if (p->buf[i] == '\\') {
+            esc = true;
+            i++;
+        }
+        i++;
+    }
+    if (i >= p->len) {
+        p->pos = i;
+        return json_err(p);
+    }
+    jsoff_t n = i - start;
+    const char *s = &p->buf[start];
+    p->pos = i + 1;
+    jsval_t v;
+    if (!esc) {
+        if (iskey && vtype(v = json_key(p, s, n, &slot)) == T_STR) {
+            return v;
+        }
+        v = js_mkstr(js, s, n);
+    } else {
+        //直接解码到arena里面，解码完再把多出来的尾巴还回去
+        v = js_mkstr(js, NULL, n);
+        if (is_err(v)) {
+            return v;
+        }
+        jsoff_t off = (jsoff_t)vdata(v);
+        jsoff_t size = esize(loadoff(js, off));
+        jsoff_t dlen = json_unescape(&js->mem[off + sizeof(off)], s, n);
+        if (dlen == ~0U) {
+            js_free(js, off, size);
+            p->pos = start;
+            return json_err(p);
+        }
+        jsoff_t b = ((dlen + 1) << 2) | T_STR;
+        memcpy(&js->mem[off], &b, sizeof(b));
+        js->mem[off + sizeof(off) + dlen] = 0;
+        if (esize(b) < size) {
+            //多出来的尾巴先写上字符串的头部，释放以后算死的字符串
+            jsoff_t tail = ((size - esize(b) - (jsoff_t)sizeof(tail)) << 2) | T_STR;
+            memcpy(&js->mem[off + esize(b)], &tail, sizeof(tail));
+            js_free(js, off + esize(b), size - esize(b));
+        }
+        if (iskey) {
+            jsval_t k = json_key(p, (const char *)&js->mem[off + sizeof(off)], dlen, &slot);
+            if (vtype(k) == T_STR) {
+                js_free(js, off, esize(b));
+                return k;
+            }
+        }
+    }
+    if (iskey && !is_err(v)) {
+        p->keys[slot] = (jsoff_t)vdata(v);
+    }
+    return v;
+}
+
+static jsval_t json_num(struct jsonp *p)
+{
+    const char *b = p->buf;
+    jsoff_t i = p->pos, n = 0;
+    if (i < p->len && b[i] == '-') {
+        i++;
+    }
+    if (i >= p->len || !is_digit(b[i])) {
+        return json_err(p);
+    }
+    if (b[i] == '0') {
+        i++;
+    } else {
+        while (i < p->len && is_digit(b[i])) {
+            i++;
+        }
+    }
+    if (i < p->len && b[i] == '.') {
+        if (++i >= p->len || !is_digit(b[i])) {
+            return json_err(p);
+        }
+        while (i < p->len && is_digit(b[i])) {
+            i++;
+        }
+    }
+    if (i < p->len && (b[i] == 'e' || b[i] == 'E')) {
+        i++;
+        if (i < p->len && (b[i] == '+' || b[i] == '-')) {
+            i++;
+        }
+        if (i >= p->len || !is_digit(b[i])) {
+            return json_err(p);
+        }
+        while (i < p->len && is_digit(b[i])) {
+            i++;
+        }
+    }
+    bool neg = b[p->pos] == '-';
+    double d = parsenum(&b[p->pos + neg], i - p->pos - neg, &n);
+    p->pos = i;
+    return mknum(neg ? -d : d);
+}
+
+static jsval_t json_val(struct jsonp *p);
+
+/*
+    对象的prop按照文档顺序追加在链表尾部。
+*/
+static jsval_t json_append(struct js *js, jsval_t obj, jsoff_t *tail, jsval_t k, jsval_t v)
+{
+    jsval_t prop = mkprop(js, 0, k, v);
+    if (is_err(prop)) {
+        return prop;
+    }
+    jsoff_t off = (jsoff_t)vdata(prop);
+    if (*tail == 0) {
+        jsoff_t b = off | T_OBJ;
+        memcpy(&js->mem[vdata(obj)], &b, sizeof(b));
+    } else {
+        jsoff_t b = off | T_PROP;
+        memcpy(&js->mem[*tail], &b, sizeof(b));
+    }
+    *tail = off;
+    return prop;
+}
+
+/*
+    前OBJ_INLINE个成员先收集起来，知道个数以后一次分配刚好大小的slot，
+    再多的成员挂到prop链表上。
+*/
+static jsval_t json_mkobj(struct js *js, jsval_t *keys, jsval_t *vals, jsoff_t n)
+{
+    jsval_t obj = n == 0 ? mkobj(js, 0) : mkslotobj(js, n);
+    for (jsoff_t i = 0; i < n && !is_err(obj); i++) {
+        jsval_t res = setslot(js, obj, keys[i], vals[i]);
+        if (is_err(res)) {
+            return res;
+        }
+    }
+    return obj;
+}
+
+static jsval_t json_obj(struct jsonp *p)
+{
+    struct js *js = p->js;
+    jsval_t keys[OBJ_INLINE], vals[OBJ_INLINE], obj = js_mkundef();
+    jsoff_t tail = 0, n = 0;
+    p->pos = json_ws(p->buf, p->len, p->pos + 1);
+    if (p->pos < p->len && p->buf[p->pos] == '}') {
+        p->pos++;
+        return json_mkobj(js, keys, vals, 0);
+    }
+    for (;;) {
+        if (p->pos >= p->len || p->buf[p->pos] != '"') {
+            return json_err(p);
+        }
+        jsval_t k = json_str(p, true);
+        if (is_err(k)) {
+            return k;
+        }
+        p->pos = json_ws(p->buf, p->len, p->pos);
+        if (p->pos >= p->len || p->buf[p->pos] != ':') {
+            return json_err(p);
+        }
+        p->pos++;
+        jsval_t v = json_val(p);
+        if (is_err(v)) {
+            return v;
+        }
+        if (vtype(obj) == T_UNDEF && n < OBJ_INLINE) {
+            keys[n] = k;
+            vals[n++] = v;
+        } else {
+            if (vtype(obj) == T_UNDEF && is_err(obj = json_mkobj(js, keys, vals, n))) {
+                return obj;
+            }
+            jsval_t prop = json_append(js, obj, &tail, k, v);
+            if (is_err(prop)) {
+                return prop;
+            }
+        }
+        p->pos = json_ws(p->buf, p->len, p->pos);
+        if (p->pos < p->len && p->buf[p->pos] == ',') {
+            p->pos = json_ws(p->buf, p->len, p->pos + 1);
+        } else if (p->pos < p->len && p->buf[p->pos] == '}') {
+            p->pos++;
+            return vtype(obj) == T_UNDEF ? json_mkobj(js, keys, vals, n) : obj;
+        } else {
+            return json_err(p);
+        }
+    }
+}
+
+static jsval_t json_arr(struct jsonp *p)
+{
+    jsval_t arr = mkarr(p->js, 0);
+    if (is_err(arr)) {
+        return arr;
+    }
+    p->pos = json_ws(p->buf, p->len, p->pos + 1);
+    if (p->pos < p->len && p->buf[p->pos] == ']') {
+        p->pos++;
+        return arr;
+    }
+    for (;;) {
+        jsval_t v = json_val(p);
+        if (is_err(v)) {
+            return v;
+        }
+        jsval_t res = js_arr_push(p->js, arr, &v, 1);
+        if (is_err(res)) {
+            return res;
+        }
+        p->pos = json_ws(p->buf, p->len, p->pos);
+        if (p->pos < p->len && p->buf[p->pos] == ',') {
+            p->pos++;
+        } else if (p->pos < p->len && p->buf[p->pos] == ']') {
+            p->pos++;
+            return arr;
+        } else {
+            return json_err(p);
+        }
+    }
+}
+
+static jsval_t json_val(struct jsonp *p)
+{
+    jsval_t res;
+    p->pos = json_ws(p->buf, p->len, p->pos);
+    if (p->pos >= p->len) {
+        return json_err(p);
+    }
+    const char *b = &p->buf[p->pos];
+    jsoff_t left = p->len - p->pos;
+    switch (b[0]) {
+        case '{':
+        case '[':
+            if (++p->depth > JSON_MAXDEPTH) {
+                return js_mkerr(p->js, "json too deep");
+            }
+            res = b[0] == '{' ? json_obj(p) : json_arr(p);
+            p->depth--;
+            return res;
+        case '"':
+            return json_str(p, false);
+        case 't':
+            if (streq("true", 4, b, left < 4 ? left : 4)) {
+                p->pos += 4;
+                return js_mktrue();
+            }
+            break;
+        case 'f':
+            if (streq("false", 5, b, left < 5 ? left : 5)) {
+                p->pos += 5;
+                return js_mkfalse();
+            }
+            break;
+        case 'n':
+            if (streq("null", 4, b, left < 4 ? left : 4)) {
+                p->pos += 4;
+                return js_mknull();
+            }
+            break;
+        default:
+            return json_num(p);
+    }
+    return json_err(p);
+}
+
+jsval_t js_json_parse(struct js *js, const char *buf, size_t len)
+{
+    struct jsonp p;
+    memset(&p, 0, sizeof(p));
+    p.js = js;
+    p.buf = buf;
+    p.len = (jsoff_t)len;
+    jsval_t res = json_val(&p);
+    if (!is_err(res) && json_ws(buf, p.len, p.pos) != p.len) {
+        return json_err(&p);
+    }
+    return res;
+}
+
+/*
+    序列化的输出buffer，和snprintf一样，n记录需要的总长度，
+    放不下的部分丢掉。
+*/
+struct jsonw {
+    char *buf;
+    size_t len;
+    size_t n;
+};
+
+static void json_put(struct jsonw *w, const char *s, size_t n)
+{
+    if (w->n < w->len) {
+        size_t room = w->len - w->n;
+        memcpy(&w->buf[w->n], s, n < room ? n : room);
+    }
+    w->n += n;
+}
+
+static void json_putstr(struct jsonw *w, const char *s, jsoff_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    jsoff_t i, run = 0;
+    json_put(w, "\"", 1);
+    for (i = 0; i < n; i++) {
+        uint8_t c = (uint8_t)s[i];
+        char esc[6] = {'\\', 0, '0', '0', 0, 0};
+        size_t elen = 2;
+        if (c == '"' || c == '\\') {
+            esc[1] = (char)c;
+        } else if (c == '\n') {
+            esc[1] = 'n';
+        } else if (c == '\r') {
+            esc[1] = 'r';
+        } else if (c == '\t') {
+            esc[1] = 't';
+        } else if (c == '\b') {
+            esc[1] = 'b';
+        } else if (c == '\f') {
+            esc[1] = 'f';
+        } else if (c < 0x20) {
+            esc[1] = 'u';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 15];
+            elen = 6;
+        } else {
+            continue;
+        }
+        //不需要转义的一段直接整块拷贝
+        json_put(w, &s[run], i - run);
+        json_put(w, esc, elen);
+        run = i + 1;
+    }
+    json_put(w, &s[run], n - run);
+    json_put(w, "\"", 1);
+}
+
+static bool json_skip(jsval_t v)
+{
+    uint8_t t = vtype(v);
+    return t == T_UNDEF || t == T_FUNC || t == T_CFUNC || t == T_CODEREF;
+}
+
+static bool json_write(struct js *js, struct jsonw *w, jsval_t v, int depth)
+{
+    char num[NUM_BUFSZ];
+    const char *str;
+    jsoff_t len, off;
+    bool first = true;
+    if (depth > JSON_MAXDEPTH) {
+        return false;//太深，或者有循环引用
+    }
+    switch (vtype(v)) {
+        case T_NUM:
+            if (isfinite(tod(v))) {
+                json_put(w, num, fmtnum(tod(v), num));
+            } else {
+                json_put(w, "null", 4);
+            }
+            return true;
+        case T_BOOL:
+            if (vdata(v)) {
+                json_put(w, "true", 4);
+            } else {
+                json_put(w, "false", 5);
+            }
+            return true;
+        case T_STR:
+            str = vstr(js, v, &len);
+            json_putstr(w, str, len);
+            return true;
+        case T_PROP:
+            return json_write(js, w, resolveprop(js, v), depth);
+        case T_OBJ:
+            json_put(w, "{", 1);
+            if (has_slots(js, v)) {
+                jsoff_t shape = objshape(js, v);
+                for (jsoff_t i = 0, n = shapelen(js, shape); i < n; i++) {
+                    jsoff_t koff = shapekey(js, shape, i);
+                    jsval_t val = loadval(js, slotoff(v, i));
+                    if (json_skip(val)) {
+                        continue;
+                    }
+                    if (!first) {
+                        json_put(w, ",", 1);
+                    }
+                    first = false;
+                    json_putstr(w, (const char *)&js->mem[koff + sizeof(koff)],
+                        offtolen(loadoff(js, koff)));
+                    json_put(w, ":", 1);
+                    if (!json_write(js, w, val, depth + 1)) {
+                        return false;
+                    }
+                }
+            }
+            off = loadoff(js, (jsoff_t)vdata(v)) & ~3U;
+            while (off != 0) {
+                jsoff_t koff = loadoff(js, off + sizeof(off));
+                jsval_t val = loadval(js, off + sizeof(off) * 2);
+                off = loadoff(js, off) & ~3U;
+                if (json_skip(val)) {
+                    continue;
+                }
+                if (!first) {
+                    json_put(w, ",", 1);
+                }
+                first = false;
+                json_putstr(w, (const char *)&js->mem[koff + sizeof(koff)],
+                    offtolen(loadoff(js, koff)));
+                json_put(w, ":", 1);
+                if (!json_write(js, w, val, depth + 1)) {
+                    return false;
+                }
+            }
+            json_put(w, "}", 1);
+            return true;
+        case T_ARR:
+        case T_VIEW:
+            json_put(w, "[", 1);
+            for (off = 0, len = (jsoff_t)js_arr_len(js, v); off < len; off++) {
+                jsval_t val = js_arr_get(js, v, off);
+                if (off > 0) {
+                    json_put(w, ",", 1);
+                }
+                if (json_skip(val)) {
+                    json_put(w, "null", 4);
+                } else if (!json_write(js, w, val, depth + 1)) {
+                    return false;
+                }
+            }
+            json_put(w, "]", 1);
+            return true;
+        default:
+            json_put(w, "null", 4);
+            return true;
+    }
+}
+
+/*
+    和snprintf一样，返回需要的长度（不包括结尾的0），out总是以0结尾。
+    嵌套太深（比如循环引用）返回0。
+*/
+size_t js_json_stringify(struct js *js, jsval_t val, char *out, size_t len)
+{
+    struct jsonw w = {out, len, 0};
+    if (!json_write(js, &w, val, 0)) {
+        w.n = 0;
+    }
+    if (len > 0) {
+        out[w.n < len ? w.n : len - 1] = '\0';
+    }
+    return w.n;
+}
+
+/*
+    批量数值运算的内置函数，参数可以是数组或者typed array。
+    数组的元素全是数字、或者是Float64Array的时候，元素就是连续的double，
+    走SIMD kernel，运行时按CPU选AVX2或者SSE2，其他平台用标量版本。
+    Int32Array/Uint8Array逐个元素处理。
+    SIMD版本的累加顺序和逐个相加不一样，最后几位可能有差别。
+*/
+struct numops {
+    double (*sum)(const uint8_t *x, size_t n);
+    double (*dot)(const uint8_t *x, const uint8_t *y, size_t n);
+    bool (*minmax)(const uint8_t *x, size_t n, double *mn, double *mx);//有NaN返回false
+    void (*axpy)(double a, const uint8_t *x, uint8_t *y, size_t n);
+};
+
+static double ldnum(const uint8_t *p, size_t i)
+{
+    double d;
+    memcpy(&d, p + i * sizeof(d), sizeof(d));
+    return d;
+}
+
+//y可能是数组的元素，结果要和mknum一样装箱，溢出的Infinity-Infinity会得到正的NaN
+static void stnum(uint8_t *p, size_t i, double d)
+{
+    jsval_t v = mknum(d);
+    memcpy(p + i * sizeof(v), &v, sizeof(v));
+}
+
+static double sum_scalar(const uint8_t *x, size_t n)
+{
+    double s = 0;
+    for (size_t i = 0; i < n; i++) {
+        s += ldnum(x, i);
+    }
+    return s;
+}
+
+static double dot_scalar(const uint8_t *x, const uint8_t *y, size_t n)
+{
+    double s = 0;
+    for (size_t i = 0; i < n; i++) {
+        s += ldnum(x, i) * ldnum(y, i);
+    }
+    return s;
+}
+
+static bool minmax_scalar(const uint8_t *x, size_t n, double *mn, double *mx)
+{
+    for (size_t i = 0; i < n; i++) {
+        double d = ldnum(x, i);
+        if (isnan(d)) {
+            return false;
+        }
+        *mn = d < *mn ? d : *mn;
+        *mx = d > *mx ? d : *mx;
+    }
+    return true;
+}
+
+static void axpy_scalar(double a, const uint8_t *x, uint8_t *y, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        stnum(y, i, a * ldnum(x, i) + ldnum(y, i));
+    }
+}
+
+static const struct numops numops_scalar = {sum_scalar, dot_scalar, minmax_scalar, axpy_scalar};
+static bool numscalar;//js_numlib_simd(false)以后只用标量的版本
+
+#ifdef NUM_X86
+//SSE2是x86-64的基础指令集，不需要检测
+static double sum_sse2(const uint8_t *x, size_t n)
+{
+    __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+    double t[2];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a0 = _mm_add_pd(a0, _mm_loadu_pd((const double *)(x + i * 8)));
+        a1 = _mm_add_pd(a1, _mm_loadu_pd((const double *)(x + i * 8 + 16)));
+    }
+    _mm_storeu_pd(t, _mm_add_pd(a0, a1));
+    return t[0] + t[1] + sum_scalar(x + i * 8, n - i);
+}
+
+static double dot_sse2(const uint8_t *x, const uint8_t *y, size_t n)
+{
+    __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+    double t[2];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd((const double *)(x + i * 8)),
+            _mm_loadu_pd((const double *)(y + i * 8))));
+        a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd((const double *)(x + i * 8 + 16)),
+            _mm_loadu_pd((const double *)(y + i * 8 + 16))));
+    }
+    _mm_storeu_pd(t, _mm_add_pd(a0, a1));
+    return t[0] + t[1] + dot_scalar(x + i * 8, y + i * 8, n - i);
+}
+
+static bool minmax_sse2(const uint8_t *x, size_t n, double *mn, double *mx)
+{
+    __m128d lo = _mm_set1_pd(*mn), hi = _mm_set1_pd(*mx), nan = _mm_setzero_pd();
+    double t[2];
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd((const double *)(x + i * 8));
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+        lo = _mm_min_pd(lo, v);
+        hi = _mm_max_pd(hi, v);
+    }
+    if (_mm_movemask_pd(nan) != 0) {
+        return false;
+    }
+    _mm_storeu_pd(t, lo);
+    *mn = t[0] < t[1] ? t[0] : t[1];
+    _mm_storeu_pd(t, hi);
+    *mx = t[0] > t[1] ? t[0] : t[1];
+    return minmax_scalar(x + i * 8, n - i, mn, mx);
+}
+
+static void axpy_sse2(double a, const uint8_t *x, uint8_t *y, size_t n)
+{
+    __m128d va = _mm_set1_pd(a), sign = _mm_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_add_pd(_mm_mul_pd(va, _mm_loadu_pd((const double *)(x + i * 8))),
+            _mm_loadu_pd((const double *)(y + i * 8)));
+        v = _mm_or_pd(v, _mm_and_pd(_mm_cmpunord_pd(v, v), sign));//NaN设上符号位，和stnum一样
+        _mm_storeu_pd((double *)(y + i * 8), v);
+    }
+    axpy_scalar(a, x + i * 8, y + i * 8, n - i);
+}
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static double hsum256(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    double t[2];
+    _mm_storeu_pd(t, s);
+    return t[0] + t[1];
+}
+
+AVX2 static double sum_avx2(const uint8_t *x, size_t n)
+{
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_add_pd(a0, _mm256_loadu_pd((const double *)(x + i * 8)));
+        a1 = _mm256_add_pd(a1, _mm256_loadu_pd((const double *)(x + i * 8 + 32)));
+    }
+    return hsum256(_mm256_add_pd(a0, a1)) + sum_scalar(x + i * 8, n - i);
+}
+
+AVX2 static double dot_avx2(const uint8_t *x, const uint8_t *y, size_t n)
+{
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_fmadd_pd(_mm256_loadu_pd((const double *)(x + i * 8)),
+            _mm256_loadu_pd((const double *)(y + i * 8)), a0);
+        a1 = _mm256_fmadd_pd(_mm256_loadu_pd((const double *)(x + i * 8 + 32)),
+            _mm256_loadu_pd((const double *)(y + i * 8 + 32)), a1);
+    }
+    return hsum256(_mm256_add_pd(a0, a1)) + dot_scalar(x + i * 8, y + i * 8, n - i);
+}
+
+AVX2 static bool minmax_avx2(const uint8_t *x, size_t n, double *mn, double *mx)
+{
+    __m256d lo = _mm256_set1_pd(*mn), hi = _mm256_set1_pd(*mx), nan = _mm256_setzero_pd();
+    double t[4];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd((const double *)(x + i * 8));
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        lo = _mm256_min_pd(lo, v);
+        hi = _mm256_max_pd(hi, v);
+    }
+    if (_mm256_movemask_pd(nan) != 0) {
+        return false;
+    }
+    _mm256_storeu_pd(t, lo);
+    for (int j = 0; j < 4; j++) {
+        *mn = t[j] < *mn ? t[j] : *mn;
+    }
+    _mm256_storeu_pd(t, hi);
+    for (int j = 0; j < 4; j++) {
+        *mx = t[j] > *mx ? t[j] : *mx;
+    }
+    return minmax_scalar(x + i * 8, n - i, mn, mx);
+}
+
+AVX2 static void axpy_avx2(double a, const uint8_t *x, uint8_t *y, size_t n)
+{
+    __m256d va = _mm256_set1_pd(a), sign = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_fmadd_pd(va, _mm256_loadu_pd((const double *)(x + i * 8)),
+            _mm256_loadu_pd((const double *)(y + i * 8)));
+        v = _mm256_or_pd(v, _mm256_and_pd(_mm256_cmp_pd(v, v, _CMP_UNORD_Q), sign));
+        _mm256_storeu_pd((double *)(y + i * 8), v);
+    }
+    axpy_scalar(a, x + i * 8, y + i * 8, n - i);
+}
+
+static const struct numops numops_sse2 = {sum_sse2, dot_sse2, minmax_sse2, axpy_sse2};
+static const struct numops numops_avx2 = {sum_avx2, dot_avx2, minmax_avx2, axpy_avx2};
+#endif
+
+static const struct numops *numops(void)
+{
+    static const struct numops *ops;
+    if (numscalar) {
+        return &numops_scalar;
+    }
+    if (ops == NULL) {
+#ifdef NUM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            ops = &numops_avx2;
+        } else {
+            ops = &numops_sse2;
+        }
+#else
+        ops = &numops_scalar;
+#endif
+    }
+    return ops;
+}
+
+bool js_numlib_simd(bool on)
+{
+    numscalar = !on;
+    return numops() != &numops_scalar;
+}
+
+/*
+    能拿到连续的double就返回true，*n总是返回元素个数。
+    数组里面可能混了非数字，要用numboxed检查。
+*/
+static bool numdata(struct js *js, jsval_t v, uint8_t **p, size_t *n)
+{
+    if (vtype(v) == T_VIEW) {
+        struct jsview view = loadview(js, v);
+        *p = (uint8_t *)view.ptr;
+        *n = view.len;
+        return view.type == JS_FLOAT64;
+    }
+    if (vtype(v) == T_ARR) {
+        *p = &js->mem[arrstor(js, v) + sizeof(jsoff_t)];
+        *n = arrlen(js, v);
+        return true;
+    }
+    *n = 0;
+    return false;
+}
+
+/*
+    装箱的值的位都是正的NaN，所以sum/dot/min/max先直接算，
+    结果不是有限数的时候才需要检查，正常情况下只扫一遍。
+*/
+static bool numboxed(jsval_t v, const uint8_t *p, size_t n)
+{
+    size_t boxed = 0;
+    if (vtype(v) != T_ARR) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        jsval_t e;
+        memcpy(&e, p + i * sizeof(e), sizeof(e));
+        boxed += (e >> 52) == 0x7ffU;//和is_nan一样，写成这样编译器可以向量化
+    }
+    return boxed != 0;
+}
+
+static bool numget(struct js *js, jsval_t v, size_t i, double *d)
+{
+    jsval_t e = js_arr_get(js, v, i);
+    *d = tod(e);
+    return vtype(e) == T_NUM;
+}
+
+static bool is_seq(jsval_t v)
+{
+    return vtype(v) == T_ARR || vtype(v) == T_VIEW;
+}
+
+//直接改数组的元素存储之前记undo log，view是宿主的内存不用记
+static void numundo(struct js *js, jsval_t v, const uint8_t *p, size_t n)
+{
+    if (vtype(v) == T_ARR) {
+        undolog(js, (jsoff_t)(p - js->mem), (jsoff_t)(n * sizeof(jsval_t)));
+    }
+}
+
+static jsval_t nl_sum(struct js *js, jsval_t *args, int nargs)
+{
+    uint8_t *p;
+    size_t n;
+    double s = 0, d;
+    if (nargs < 1 || !is_seq(args[0])) {
+        return js_mkerr(js, "sum: bad args");
+    }
+    if (numdata(js, args[0], &p, &n)) {
+        s = numops()->sum(p, n);
+        if (isfinite(s) || !numboxed(args[0], p, n)) {
+            return mknum(s);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!numget(js, args[0], i, &d)) {
+            return js_mkerr(js, "sum: not a number");
+        }
+        s += d;
+    }
+    return mknum(s);
+}
+
+static jsval_t nl_mean(struct js *js, jsval_t *args, int nargs)
+{
+    jsval_t s = nl_sum(js, args, nargs);
+    if (is_err(s)) {
+        return s;
+    }
+    return mknum(tod(s) / (double)js_arr_len(js, args[0]));
+}
+
+/*
+    有NaN结果就是NaN。空的时候和Math.min/Math.max一样，min是+Infinity，max是-Infinity。
+*/
+static jsval_t minmax(struct js *js, jsval_t *args, int nargs, bool wantmax)
+{
+    uint8_t *p;
+    size_t n;
+    double mn = INFINITY, mx = -INFINITY, d;
+    bool ok = true;
+    if (nargs < 1 || !is_seq(args[0])) {
+        return js_mkerr(js, "min/max: bad args");
+    }
+    bool fast = numdata(js, args[0], &p, &n);
+    if (fast) {
+        ok = numops()->minmax(p, n, &mn, &mx);
+        fast = (ok && isfinite(mn) && isfinite(mx)) || !numboxed(args[0], p, n);
+    }
+    if (!fast) {
+        ok = true;
+        mn = INFINITY;
+        mx = -INFINITY;
+        for (size_t i = 0; i < n && ok; i++) {
+            if (!numget(js, args[0], i, &d)) {
+                return js_mkerr(js, "min/max: not a number");
+            }
+            ok = !isnan(d);
+            mn = d < mn ? d : mn;
+            mx = d > mx ? d : mx;
+        }
+    }
+    if (n == 0) {
+        return mknum(wantmax ? -INFINITY : INFINITY);
+    }
+    return ok ? tov(wantmax ? mx : mn) : mknum(NAN);
+}
+
+static jsval_t nl_min(struct js *js, jsval_t *args, int nargs)
+{
+    return minmax(js, args, nargs, false);
+}
+
+static jsval_t nl_max(struct js *js, jsval_t *args, int nargs)
+{
+    return minmax(js, args, nargs, true);
+}
+
+//两个序列长度不一样的时候按短的算
+static jsval_t nl_dot(struct js *js, jsval_t *args, int nargs)
+{
+    uint8_t *x, *y;
+    size_t nx, ny;
+    double s = 0, a, b;
+    if (nargs < 2 || !is_seq(args[0]) || !is_seq(args[1])) {
+        return js_mkerr(js, "dot: bad args");
+    }
+    bool fx = numdata(js, args[0], &x, &nx), fy = numdata(js, args[1], &y, &ny);
+    size_t n = nx < ny ? nx : ny;
+    if (fx && fy) {
+        s = numops()->dot(x, y, n);
+        if (isfinite(s) || (!numboxed(args[0], x, n) && !numboxed(args[1], y, n))) {
+            return mknum(s);
+        }
+        s = 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!numget(js, args[0], i, &a) || !numget(js, args[1], i, &b)) {
+            return js_mkerr(js, "dot: not a number");
+        }
+        s += a * b;
+    }
+    return mknum(s);
+}
+
+//axpy(a, x, y)：y[i] += a * x[i]，直接改y，返回y
+static jsval_t nl_axpy(struct js *js, jsval_t *args, int nargs)
+{
+    uint8_t *x, *y;
+    size_t nx, ny;
+    double a, b;
+    if (nargs < 3 || vtype(args[0]) != T_NUM || !is_seq(args[1]) || !is_seq(args[2])) {
+        return js_mkerr(js, "axpy: bad args");
+    }
+    bool fx = numdata(js, args[1], &x, &nx), fy = numdata(js, args[2], &y, &ny);
+    size_t n = nx < ny ? nx : ny;
+    //要直接写y，所以先检查
+    if (fx && fy && !numboxed(args[1], x, n) && !numboxed(args[2], y, n)) {
+        numundo(js, args[2], y, n);
+        numops()->axpy(tod(args[0]), x, y, n);
+        return args[2];
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!numget(js, args[1], i, &a) || !numget(js, args[2], i, &b)) {
+            return js_mkerr(js, "axpy: not a number");
+        }
+        js_arr_set(js, args[2], i, mknum(tod(args[0]) * a + b));
+    }
+    return args[2];
+}
+
+//前缀和，直接改参数，每一项依赖前一项，没有SIMD版本
+static jsval_t nl_prefixsum(struct js *js, jsval_t *args, int nargs)
+{
+    uint8_t *p;
+    size_t n;
+    double s = 0, d;
+    if (nargs < 1 || !is_seq(args[0])) {
+        return js_mkerr(js, "prefixsum: bad args");
+    }
+    if (numdata(js, args[0], &p, &n) && !numboxed(args[0], p, n)) {
+        numundo(js, args[0], p, n);
+        for (size_t i = 0; i < n; i++) {
+            s += ldnum(p, i);
+            stnum(p, i, s);
+        }
+        return args[0];
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!numget(js, args[0], i, &d)) {
+            return js_mkerr(js, "prefixsum: not a number");
+        }
+        s += d;
+        js_arr_set(js, args[0], i, mknum(s));
+    }
+    return args[0];
+}
+
+//histogram(x, lo, hi, nbins)：返回nbins个计数，[lo, hi)以外的和NaN不计
+static jsval_t nl_histogram(struct js *js, jsval_t *args, int nargs)
+{
+    double d;
+    if (nargs < 4 || !is_seq(args[0]) || vtype(args[1]) != T_NUM ||
+        vtype(args[2]) != T_NUM || vtype(args[3]) != T_NUM) {
+        return js_mkerr(js, "histogram: bad args");
+    }
+    double lo = tod(args[1]), hi = tod(args[2]), nb = tod(args[3]);
+    if (!(hi > lo) || !(nb >= 1) || nb > ARR_MAXCAP) {
+        return js_mkerr(js, "histogram: bad range");
+    }
+    jsoff_t nbins = (jsoff_t)nb;
+    jsval_t res = mkarr(js, nbins);
+    if (is_err(res)) {
+        return res;
+    }
+    //计数直接按double存在元素存储里面
+    uint8_t *cnt = &js->mem[arrstor(js, res) + sizeof(jsoff_t)];
+    memset(cnt, 0, nbins * sizeof(double));
+    saveoff(js, (jsoff_t)vdata(res) + sizeof(jsoff_t), nbins);
+    double scale = nbins / (hi - lo);
+    for (size_t i = 0, n = js_arr_len(js, args[0]); i < n; i++) {
+        if (!numget(js, args[0], i, &d)) {
+            return js_mkerr(js, "histogram: not a number");
+        }
+        if (d >= lo && d < hi) {
+            size_t b = (size_t)((d - lo) * scale);
+            b = b < nbins ? b : nbins - 1;
+            stnum(cnt, b, ldnum(cnt, b) + 1);
+        }
+    }
+    return res;
+}
+
+/*
+    在全局scope里面注册num对象：num.sum(x)、num.dot(x, y)等等。
+*/
+jsval_t js_numlib(struct js *js)
+{
+    static const struct {
+        const char *name;
+        jsval_t (*fn)(struct js *, jsval_t *, int);
+    } fns[] = {
+        {"sum", nl_sum}, {"mean", nl_mean}, {"min", nl_min}, {"max", nl_max},
+        {"dot", nl_dot}, {"axpy", nl_axpy}, {"prefixsum", nl_prefixsum},
+        {"histogram", nl_histogram},
+    };
+    jsval_t lib = mkobj(js, 0);
+    if (is_err(lib)) {
+        return lib;
+    }
+    for (size_t i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+        jsval_t res = js_set(js, lib, fns[i].name, js_mkfun(fns[i].fn));
+        if (is_err(res)) {
+            return res;
+        }
+    }
+    jsval_t res = js_set(js, mkval(T_OBJ, 0), "num", lib);
+    return is_err(res) ? res : lib;
+}
+
+/*
+    模板JIT，只有linux x86-64有，默认关闭，js_jit(js, true)打开。
+    js函数每次被调用都按函数字符串的offset计数，连续JIT_HOT次参数都是数字，就把函数编译成机器码，
+    之后参数都是数字的调用直接执行机器码，不再建scope、绑定参数、解释执行。
+    能编译的函数体只有若干个 let 变量 = 表达式; 再加一个 return 表达式;
+    表达式里面只能有参数、前面的局部变量、数字和true/false、括号，
+    运算符只有 + - * / < <= > >= === !== ! 一元+- 和 ?:，每个值是数字还是bool编译的时候就确定了。
+    全局变量是动态查找的，不能编译，编译不了的函数记下来以后不再尝试。
+    参数的类型在调用机器码之前检查，不是数字就退回解释器，退回JIT_MAXDEOPT次以后放弃机器码。
+    机器码用SSE2算double，当前值在xmm0里面，临时值压栈，局部变量放在rbp下面。
+    可执行内存先写好再mprotect成只读可执行，不会同时可写可执行；mprotect不允许的宿主js_jit会返回false。
+    JIT表是arena里面的blob，跟site表一样不进cache；rollback的时候mark以后的函数从表里面去掉，机器码的空间退回去。
+*/
+#define JIT_NFUNCS 32
+#define JIT_HOT 16
+#define JIT_MAXDEOPT 8
+#define JIT_MAXVARS 8 //参数加局部变量
+#define JIT_MAXCODE 2048 //一个函数的机器码
+#define JIT_CODESZ (64 * 1024)
+
+enum { J_COUNT, J_CODE, J_NONE };
+enum { JK_NUM, JK_BOOL, JK_FAIL };
+
+struct jitfn {
+    jsoff_t fn;//函数字符串的offset，0表示空位
+    uint32_t hits;
+    uint32_t code;//机器码在jitmem里面的offset
+    uint32_t size;
+    uint8_t state;
+    uint8_t nparams;
+    uint8_t kind;//返回值是数字还是bool
+    uint8_t deopts;
+};
+
+#ifdef JS_JIT
+struct jitc {
+    struct js *js;
+    uint8_t code[JIT_MAXCODE];
+    jsoff_t n;
+    bool full;
+    const char *names[JIT_MAXVARS];
+    jsoff_t lens[JIT_MAXVARS];
+    uint8_t kinds[JIT_MAXVARS];
+    int nparams;
+    int nvars;
+    int depth;
+};
+
+static void jit_emit(struct jitc *c, const uint8_t *b, jsoff_t n)
+{
+    if (c->n + n > JIT_MAXCODE) {
+        c->full = true;
+        return;
+    }
+    memcpy(&c->code[c->n], b, n);
+    c->n += n;
+}
+#define EMIT(...) do { const uint8_t b_[] = {__VA_ARGS__}; jit_emit(c, b_, sizeof(b_)); } while (0)
+
+static void jit_emit32(struct jitc *c, uint32_t v)
+{
+    EMIT(v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24);
+}
+
+static void jit_emit64(struct jitc *c, uint64_t v)
+{
+    jit_emit32(c, (uint32_t)v);
+    jit_emit32(c, (uint32_t)(v >> 32));
+}
+
+//把at处的rel32改成跳到当前位置
+static void jit_patch(struct jitc *c, jsoff_t at)
+{
+    uint32_t rel = c->n - (at + 4);
+    if (!c->full) {
+        memcpy(&c->code[at], &rel, sizeof(rel));
+    }
+}
+
+//xmm0 = 常数
+static void jit_const(struct jitc *c, double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    EMIT(0x48, 0xb8);//mov rax, imm64
+    jit_emit64(c, bits);
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0);//movq xmm0, rax
+}
+
+//al -> xmm0 = 0.0或者1.0
+static void jit_setbool(struct jitc *c)
+{
+    EMIT(0x0f, 0xb6, 0xc0);//movzx eax, al
+    EMIT(0xf2, 0x0f, 0x2a, 0xc0);//cvtsi2sd xmm0, eax
+}
+
+//xmm0和0比较，0和NaN的时候ZF=1
+static void jit_test(struct jitc *c)
+{
+    EMIT(0x66, 0x0f, 0x57, 0xc9);//xorpd xmm1, xmm1
+    EMIT(0x66, 0x0f, 0x2e, 0xc1);//ucomisd xmm0, xmm1
+}
+
+static int jit_var(struct jitc *c, const char *name, jsoff_t len)
+{
+    for (int i = 0; i < c->nvars; i++) {
+        if (streq(c->names[i], c->lens[i], name, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool jit_addvar(struct jitc *c, uint8_t kind)
+{
+    const char *name = c->js->code + c->js->toff;
+    if (c->nvars >= JIT_MAXVARS || jit_var(c, name, c->js->tlen) >= 0) {
+        return false;
+    }
+    c->names[c->nvars] = name;
+    c->lens[c->nvars] = c->js->tlen;
+    c->kinds[c->nvars++] = kind;
+    return true;
+}
+
+//参数在[rdi + 8 * i]，局部变量在[rbp - 8 * (i + 1)]
+static void jit_varop(struct jitc *c, int i, uint8_t op)
+{
+    if (i < c->nparams) {
+        EMIT(0xf2, 0x0f, op, 0x87);
+        jit_emit32(c, (uint32_t)(8 * i));
+    } else {
+        EMIT(0xf2, 0x0f, op, 0x85);
+        jit_emit32(c, (uint32_t)(-8 * (i - c->nparams + 1)));
+    }
+}
+
+static uint8_t jit_expr(struct jitc *c, uint8_t minprec);
+
+static uint8_t jit_unary(struct jitc *c)
+{
+    struct js *js = c->js;
+    uint8_t tok = next(js), k = JK_FAIL;
+    int i;
+    if (++c->depth > EXPR_MAXDEPTH) {
+        return JK_FAIL;
+    }
+    js->consumed = 1;
+    switch (tok) {
+        case TOK_LPAREN:
+            k = jit_expr(c, 2);
+            if (next(js) != TOK_RPAREN) {
+                k = JK_FAIL;
+            }
+            js->consumed = 1;
+            break;
+        case TOK_MINUS:
+        case TOK_PLUS:
+            k = jit_unary(c) == JK_NUM ? JK_NUM : JK_FAIL;
+            if (tok == TOK_MINUS) {
+                EMIT(0x48, 0xb8);//mov rax, 符号位
+                jit_emit64(c, 0x8000000000000000ULL);
+                EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc8);//movq xmm1, rax
+                EMIT(0x66, 0x0f, 0x57, 0xc1);//xorpd xmm0, xmm1
+            }
+            break;
+        case TOK_NOT:
+            k = jit_unary(c) == JK_FAIL ? JK_FAIL : JK_BOOL;
+            jit_test(c);
+            EMIT(0x0f, 0x94, 0xc0);//sete al
+            jit_setbool(c);
+            break;
+        case TOK_NUMBER:
+            jit_const(c, tod(js->tval));
+            k = JK_NUM;
+            break;
+        case TOK_TRUE:
+        case TOK_FALSE:
+            jit_const(c, tok == TOK_TRUE ? 1.0 : 0.0);
+            k = JK_BOOL;
+            break;
+        case TOK_IDENTIFIER:
+            i = jit_var(c, js->code + js->toff, js->tlen);
+            if (i >= 0) {
+                jit_varop(c, i, 0x10);//movsd xmm0, [var]
+                k = c->kinds[i];
+            }
+            break;
+        default:
+            break;
+    }
+    c->depth--;
+    return k;
+}
+
+//xmm0 = xmm0 op xmm1
+static uint8_t jit_binop(struct jitc *c, uint8_t op, uint8_t l, uint8_t r)
+{
+    if (op == TOK_EQ || op == TOK_NE) {
+        if (l != r) {
+            return JK_FAIL;
+        }
+        EMIT(0x66, 0x0f, 0x2e, 0xc1);//ucomisd xmm0, xmm1
+        if (op == TOK_EQ) {
+            EMIT(0x0f, 0x94, 0xc0, 0x0f, 0x9b, 0xc1, 0x20, 0xc8);//sete al; setnp cl; and al, cl
+        } else {
+            EMIT(0x0f, 0x95, 0xc0, 0x0f, 0x9a, 0xc1, 0x08, 0xc8);//setne al; setp cl; or al, cl
+        }
+        jit_setbool(c);
+        return JK_BOOL;
+    }
+    if (l != JK_NUM || r != JK_NUM) {
+        return JK_FAIL;
+    }
+    switch (op) {
+        case TOK_PLUS: EMIT(0xf2, 0x0f, 0x58, 0xc1); return JK_NUM;//addsd xmm0, xmm1
+        case TOK_MINUS: EMIT(0xf2, 0x0f, 0x5c, 0xc1); return JK_NUM;//subsd
+        case TOK_MUL: EMIT(0xf2, 0x0f, 0x59, 0xc1); return JK_NUM;//mulsd
+        case TOK_DIV: EMIT(0xf2, 0x0f, 0x5e, 0xc1); return JK_NUM;//divsd
+        //无序（NaN）的时候CF=1，seta和setae都是0
+        case TOK_LT: EMIT(0x66, 0x0f, 0x2e, 0xc8, 0x0f, 0x97, 0xc0); break;//ucomisd xmm1, xmm0; seta al
+        case TOK_LE: EMIT(0x66, 0x0f, 0x2e, 0xc8, 0x0f, 0x93, 0xc0); break;//ucomisd xmm1, xmm0; setae al
+        case TOK_GT: EMIT(0x66, 0x0f, 0x2e, 0xc1, 0x0f, 0x97, 0xc0); break;//ucomisd xmm0, xmm1; seta al
+        case TOK_GE: EMIT(0x66, 0x0f, 0x2e, 0xc1, 0x0f, 0x93, 0xc0); break;//ucomisd xmm0, xmm1; setae al
+        default: return JK_FAIL;
+    }
+    jit_setbool(c);
+    return JK_BOOL;
+}
+
+static uint8_t jit_expr(struct jitc *c, uint8_t minprec)
+{
+    struct js *js = c->js;
+    uint8_t k = jit_unary(c);
+    while (k != JK_FAIL) {
+        uint8_t tok = next(js), prec = precof(tok);
+        if (prec == 0 || prec < minprec) {
+            break;
+        }
+        js->consumed = 1;
+        if (tok == TOK_Q) {
+            //条件是0或者NaN的时候跳到:后面
+            jit_test(c);
+            EMIT(0x0f, 0x84);//jz rel32
+            jsoff_t jz = c->n;
+            jit_emit32(c, 0);
+            uint8_t a = jit_expr(c, prec);
+            if (next(js) != TOK_COLON) {
+                return JK_FAIL;
+            }
+            js->consumed = 1;
+            EMIT(0xe9);//jmp rel32
+            jsoff_t jmp = c->n;
+            jit_emit32(c, 0);
+            jit_patch(c, jz);
+            uint8_t b = jit_expr(c, prec);
+            jit_patch(c, jmp);
+            k = a == b ? a : JK_FAIL;
+            continue;
+        }
+        EMIT(0x48, 0x83, 0xec, 0x08, 0xf2, 0x0f, 0x11, 0x04, 0x24);//sub rsp, 8; movsd [rsp], xmm0
+        uint8_t r = jit_expr(c, prec + 1);
+        EMIT(0x66, 0x0f, 0x28, 0xc8);//movapd xmm1, xmm0
+        EMIT(0xf2, 0x0f, 0x10, 0x04, 0x24, 0x48, 0x83, 0xc4, 0x08);//movsd xmm0, [rsp]; add rsp, 8
+        k = r == JK_FAIL ? JK_FAIL : jit_binop(c, tok, k, r);
+    }
+    return k;
+}
+
+static bool jit_expect(struct js *js, uint8_t tok)
+{
+    if (next(js) != tok) {
+        return false;
+    }
+    js->consumed = 1;
+    return true;
+}
+
+//编译 (参数) { let ...; return ...; }，返回值的类型放在kind里面
+static bool jit_func(struct jitc *c, uint8_t *kind)
+{
+    struct js *js = c->js;
+    EMIT(0x55, 0x48, 0x89, 0xe5, 0x48, 0x81, 0xec);//push rbp; mov rbp, rsp; sub rsp, imm32
+    jit_emit32(c, 8 * JIT_MAXVARS);
+    if (!jit_expect(js, TOK_LPAREN)) {
+        return false;
+    }
+    while (next(js) != TOK_RPAREN) {
+        if (!jit_expect(js, TOK_IDENTIFIER) || !jit_addvar(c, JK_NUM)) {
+            return false;
+        }
+        c->nparams++;
+        if (next(js) == TOK_RPAREN) {
+            break;
+        }
+        if (!jit_expect(js, TOK_COMMA)) {
+            return false;
+        }
+    }
+    js->consumed = 1;
+    if (!jit_expect(js, TOK_LBRACE)) {
+        return false;
+    }
+    while (jit_expect(js, TOK_LET)) {
+        if (!jit_expect(js, TOK_IDENTIFIER)) {
+            return false;
+        }
+        jsoff_t toff = js->toff, tlen = js->tlen;
+        if (!jit_expect(js, TOK_ASSIGN)) {
+            return false;
+        }
+        uint8_t k = jit_expr(c, 2);
+        js->toff = toff;
+        js->tlen = tlen;
+        if (k == JK_FAIL || !jit_addvar(c, k) || !jit_expect(js, TOK_SEMICOLON)) {
+            return false;
+        }
+        jit_varop(c, c->nvars - 1, 0x11);//movsd [var], xmm0
+    }
+    if (!jit_expect(js, TOK_RETURN) || (*kind = jit_expr(c, 2)) == JK_FAIL) {
+        return false;
+    }
+    jit_expect(js, TOK_SEMICOLON);
+    if (!jit_expect(js, TOK_RBRACE) || next(js) != TOK_EOF) {
+        return false;
+    }
+    EMIT(0x48, 0x89, 0xec, 0x5d, 0xc3);//mov rsp, rbp; pop rbp; ret
+    return !c->full;
+}
+
+//把机器码复制到可执行内存，失败返回false
+static bool jit_install(struct js *js, const struct jitc *c, struct jitfn *e)
 {
-    return js_assignment(js);
+    if (js->jitused + c->n > JIT_CODESZ) {
+        return false;
+    }
+    if (mprotect(js->jitmem, JIT_CODESZ, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    memcpy(js->jitmem + js->jitused, c->code, c->n);
+    if (mprotect(js->jitmem, JIT_CODESZ, PROT_READ | PROT_EXEC) != 0) {
+        js->jiton = false;//不能再执行了，也不敢再用
+        return false;
+    }
+    e->code = js->jitused;
+    e->size = c->n;
+    js->jitused += c->n;
+    return true;
 }
-// let a = 1;
-static jsval_t js_let(struct js *js)
+
+static void jit_compile(struct js *js, jsval_t func, struct jitfn *e)
 {
-    uint8_t exe = !(js->flags & F_NOEXEC);
+    static struct jitc c;//2KB多，不放在C栈上
+    jsoff_t fnlen;
+    const char *fn = vstr(js, func, &fnlen);
+    const char *code = js->code;
+    jsoff_t clen = js->clen, pos = js->pos, toff = js->toff, tlen = js->tlen;
+    uint8_t tok = js->tok, consumed = js->consumed;
+    jsval_t tval = js->tval;
+    uint8_t kind = JK_FAIL;
+    memset(&c, 0, sizeof(c));
+    c.js = js;
+    js->code = fn;
+    js->clen = fnlen;
+    js->pos = 0;
     js->consumed = 1;
-    for (;;) {
-        EXPECT(TOK_IDENTIFIER, );
-        js->consumed = 0;
-        jsoff_t noff = js->toff;//试图取出后面的identifier
-        jsoff_t nlen = js->tlen;//n是指next的意思
-        char *name = (char *)&js->code[noff];//拿到id的name
-        jsval_t v = js_mkundef();
-        js->consumed = 1;
-        //id后面就应该是一个赋值符号。
-        if (next(js) == TOK_ASSIGN) {
-            js->consumed = 1;
-            v = js_expr(js);
-            if (is_err(v)) {
-                return v;
+    bool ok = jit_func(&c, &kind) && jit_install(js, &c, e);
+    js->code = code;
+    js->clen = clen;
+    js->pos = pos;
+    js->toff = toff;
+    js->tlen = tlen;
+    js->tok = tok;
+    js->consumed = consumed;
+    js->tval = tval;
+    e->state = ok ? J_CODE : J_NONE;
+    e->nparams = (uint8_t)c.nparams;
+    e->kind = kind;
+}
+
+static jsoff_t jittab(struct js *js)
+{
+    if (js->jit == 0) {
+        js->jit = mkblob(js, NULL, JIT_NFUNCS * sizeof(struct jitfn));
+        if (js->jit != ~0U) {
+            memset(&js->mem[js->jit + sizeof(jsoff_t)], 0, JIT_NFUNCS * sizeof(struct jitfn));
+        }
+    }
+    return js->jit;
+}
+
+//前n个参数都是数字
+static bool jit_guard(const jsval_t *args, int nargs, int n)
+{
+    if (nargs < n) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        if (vtype(args[i]) != T_NUM) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+//函数有机器码而且参数都是数字就直接执行，返回true；否则计数，返回false让解释器执行
+static bool jit_call(struct js *js, jsval_t func, const jsval_t *args, int nargs, jsval_t *res)
+{
+#ifdef JS_JIT
+    struct jitfn e;
+    jsoff_t tab;
+    bool done = false;
+    if (!js->jiton || (tab = jittab(js)) == ~0U) {
+        return false;
+    }
+    jsoff_t fn = (jsoff_t)vdata(func);
+    jsoff_t off = tab + sizeof(jsoff_t) + (fn >> 2) % JIT_NFUNCS * sizeof(e);
+    memcpy(&e, &js->mem[off], sizeof(e));
+    if (e.fn != fn) {
+        memset(&e, 0, sizeof(e));//冲突了直接替换，原来的机器码作废
+        e.fn = fn;
+    }
+    if (e.state == J_CODE) {
+        if (jit_guard(args, nargs, e.nparams)) {
+            double (*f)(const void *);
+            void *p = js->jitmem + e.code;
+            memcpy(&f, &p, sizeof(f));
+            double d = f(args);
+            *res = e.kind == JK_BOOL ? mkval(T_BOOL, d != 0) : mknum(d);
+            e.hits++;
+            done = true;
+        } else if (++e.deopts >= JIT_MAXDEOPT) {
+            e.state = J_NONE;
+        }
+    } else if (e.state == J_COUNT) {
+        e.hits = jit_guard(args, nargs, nargs) ? e.hits + 1 : 0;
+        if (e.hits >= JIT_HOT) {
+            jit_compile(js, func, &e);
+        }
+    }
+    memcpy(&js->mem[off], &e, sizeof(e));
+    return done;
+#else
+    (void)js, (void)func, (void)args, (void)nargs, (void)res;
+    return false;
+#endif
+}
+
+//mark以后的函数和JIT表从表里面去掉，机器码的空间退到还在用的最高位置
+static void jit_rollback(struct js *js, struct jsmark *m)
+{
+    struct jitfn e;
+    jsoff_t top = m->jitused;
+    if (js->jit >= m->brk) {
+        js->jit = 0;
+    }
+    for (jsoff_t i = 0; i < JIT_NFUNCS && js->jit != 0 && js->jit != ~0U; i++) {
+        jsoff_t off = js->jit + sizeof(jsoff_t) + i * sizeof(e);
+        memcpy(&e, &js->mem[off], sizeof(e));
+        if (e.fn >= m->brk) {
+            memset(&js->mem[off], 0, sizeof(e));
+        } else if (e.state == J_CODE && e.code + e.size > top) {
+            top = e.code + e.size;
+        }
+    }
+    js->jitused = top < js->jitused ? top : js->jitused;
+}
+
+bool js_jit(struct js *js, bool on)
+{
+#ifdef JS_JIT
+    if (on) {
+        if (js->jitmem == NULL) {
+            void *p = mmap(NULL, JIT_CODESZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                return false;
+            }
+            if (mprotect(p, JIT_CODESZ, PROT_READ | PROT_EXEC) != 0) {
+                munmap(p, JIT_CODESZ);
+                return false;
             }
+            js->jitmem = p;
+            js->jitused = 0;
         }
+        js->jiton = true;
+        return true;
     }
+    if (js->jitmem != NULL) {
+        munmap(js->jitmem, JIT_CODESZ);
+    }
+    js->jitmem = NULL;
+#endif
+    (void)on;
+    js->jit = 0;
+    js->jitused = 0;
+    js->jiton = false;
+    return false;
 }
-static jsval_t js_stmt(struct js *js)
+
+void js_dump_jit(struct js *js)
 {
-    jsval_t res;
-    if (js->brk > js->gct) {
-        // js_gc(js);
+    static const char *states[] = {"counting", "compiled", "interpreted"};
+    struct jitfn e;
+    if (js->jit == 0 || js->jit == ~0U) {
+        return;
     }
-    switch(next(js)) {
-        case TOK_CASE:
-        case TOK_CATCH:
-        case TOK_CLASS:
-        case TOK_CONST:
-        case TOK_DEFAULT:
-        case TOK_DELETE:
-        case TOK_DO:
-        case TOK_FINALLY:
-        case TOK_IN:
-        case TOK_INSTANCEOF:
-        case TOK_NEW:
-        case TOK_SWITCH:
-        case TOK_THIS:
-        case TOK_THROW:
-        case TOK_TRY:
-        case TOK_VAR:
-        case TOK_VOID:
-        case TOK_WITH:
-        case TOK_WHILE:
-        case TOK_YIELD:
-            res = js_mkerr(js, "'%.*s not implemented", (int)js->tlen, js->code+js->toff);
-            break;
-        case TOK_CONTINUE:
-            res = js_continue(js);
-            break;
-        case TOK_BREAK:
-            res = js_break(js);
-            break;
-        case TOK_LET:
-            res = js_let(js);
-            break;
-        default:
-            break;
+    for (jsoff_t i = 0; i < JIT_NFUNCS; i++) {
+        memcpy(&e, &js->mem[js->jit + sizeof(jsoff_t) + i * sizeof(e)], sizeof(e));
+        if (e.fn == 0) {
+            continue;
+        }
+        printf("jit fn @%u %s hits %u deopts %u code %u bytes\n", (unsigned)e.fn,
+            states[e.state], (unsigned)e.hits, (unsigned)e.deopts, (unsigned)e.size);
+    }
+}
+
+/*
+    批处理：同一个rule脚本对很多条JSON记录执行。
+    开始前记下brk的位置，每条记录解析、绑定到全局变量name、执行rule，
+    结束后把brk退回到记下的位置，这条记录用的内存一次全部回收。
+    rule对批处理之前就有的变量和对象的修改记在undo log里面，每条记录结束的时候撤销。
+*/
+static void mark(struct js *js, struct jsmark *m)
+{
+    memset(js->freel, 0, sizeof(js->freel));//free list里面的块可能在mark下面被重复使用，直接放弃
+    m->brk = js->brk;
+    m->head = loadoff(js, 0);
+    m->xstr = js->xstr;
+    m->jitused = js->jitused;
+    m->undo = js->undo;
+    m->ubrk = js->ubrk;
+    m->scope = js->scope;
+    js->ubrk = js->brk;
+}
+
+//把mark以后对mark之前的内存的改写倒着恢复
+static void undo(struct js *js, struct jsmark *m)
+{
+    while (js->undo != m->undo) {
+        jsoff_t hdr[3];
+        memcpy(hdr, &js->mem[js->undo + sizeof(jsoff_t)], sizeof(hdr));
+        memcpy(&js->mem[hdr[1]], &js->mem[js->undo + sizeof(jsoff_t) + sizeof(hdr)], hdr[2]);
+        js->undo = hdr[0];
+    }
+}
+
+static void rollback(struct js *js, struct jsmark *m)
+{
+    undo(js, m);
+    js->ubrk = 0;//下面的恢复不用再记log
+    while (js->xstr != m->xstr) {
+        struct jsxstr x = loadxstr(js, mkval(T_STR, js->xstr));
+        if (x.release != NULL) {
+            x.release((void *)x.ptr);
+        }
+        js->xstr = x.next;
+    }
+    if (js->shapes >= m->brk) {
+        js->shapes = 0;
+    }
+    for (jsoff_t i = 0; i < SHAPE_CACHE && js->shapes != 0; i++) {
+        jsoff_t slot = js->shapes + (jsoff_t)sizeof(jsoff_t) * (i + 1);
+        if (loadoff(js, slot) >= m->brk) {
+            saveoff(js, slot, 0);
+        }
     }
+    if (js->sites >= m->brk) {
+        js->sites = 0;
+    }
+    if (js->prof >= m->brk) {
+        js->prof = 0;
+    }
+    jit_rollback(js, m);
+    memset(js->freel, 0, sizeof(js->freel));
+    saveoff(js, 0, m->head);
+    js->scope = m->scope;
+    js->susp = S_NONE;//挂起的记录没法resume了
+    js->brk = m->brk;
+    js->ubrk = m->brk;//mark还在，之后的改写接着记
+}
+
+/*
+    把结果留下来：标量不占内存；普通字符串挪到mark的位置，mark往后移；
+    其他的值可能引用这条记录的任何内存，整条记录都留下来。
+*/
+static jsval_t keep(struct js *js, struct jsmark *m, jsval_t res)
+{
+    uint8_t t = vtype(res);
+    if (t == T_UNDEF || t == T_NULL || t == T_NUM || t == T_BOOL || t == T_ERR) {
+        return res;
+    }
+    if (t == T_CFUNC || (jsoff_t)vdata(res) < m->brk) {
+        return res;//不在这条记录里面
+    }
+    if (t == T_STR && !is_xstr(js, res)) {
+        jsoff_t off = (jsoff_t)vdata(res), n = esize(loadoff(js, off));
+        memmove(&js->mem[m->brk], &js->mem[off], n);
+        res = mkval(T_STR, m->brk);
+        m->brk += n;
+        return res;
+    }
+    m->brk = js->brk;
+    m->xstr = js->xstr;
     return res;
 }
 
-jsval_t js_eval(struct js *js, const char *buf, size_t len)
+size_t js_batch(struct js *js, const char *name, const char *rule, size_t rlen,
+    const char *const *recs, const size_t *lens, size_t n, jsval_t *out)
+{
+    struct jsmark m;
+    size_t nerr = 0;
+    if (rlen == (size_t)~0U) {
+        rlen = strlen(rule);
+    }
+    //记录绑定的变量、site表和shape缓存都要分配在mark下面
+    jsval_t prop = lookup(js, mkval(T_OBJ, 0), name, strlen(name));
+    if (vtype(prop) == T_UNDEF) {
+        prop = js_set(js, mkval(T_OBJ, 0), name, js_mkundef());
+    }
+    if (is_err(prop) || sitetab(js) == ~0U || shapetab(js) == ~0U) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = js_mkerr(js, "oom");
+        }
+        return n;
+    }
+    jsoff_t slot = (jsoff_t)vdata(prop) + (jsoff_t)sizeof(jsoff_t) * 2;
+    mark(js, &m);
+    for (size_t i = 0; i < n; i++) {
+        jsval_t res = js_json_parse(js, recs[i], lens == NULL ? strlen(recs[i]) : lens[i]);
+        if (!is_err(res)) {
+            saveval(js, slot, res);
+            res = resolveprop(js, js_eval(js, rule, rlen));
+        }
+        undo(js, &m);//keep会把字符串挪到mark的位置，可能盖掉log，先恢复
+        out[i] = keep(js, &m, res);
+        if (is_err(res)) {
+            nerr++;
+        }
+        rollback(js, &m);
+    }
+    js->ubrk = m.ubrk;
+    saveval(js, slot, js_mkundef());
+    return nerr;
+}
+
+/*
+    堆统计：按esize从0到brk走一遍，按entity类型统计个数和字节数，
+    带E_DEAD的是释放掉的块，总数以外再按原来的类型分开。带slot的对象把后面的slot blob也算在对象里面。
+    另外记下最大的几个对象（算上它的prop）和字符串。
+*/
+#define HEAP_TOP 5
+
+struct heaptop {
+    jsoff_t off;
+    jsoff_t size;
+};
+
+static void topadd(struct heaptop *top, jsoff_t off, jsoff_t size)
+{
+    int i = HEAP_TOP - 1;
+    if (size <= top[i].size) {
+        return;
+    }
+    for (; i > 0 && top[i - 1].size < size; i--) {
+        top[i] = top[i - 1];
+    }
+    top[i].off = off;
+    top[i].size = size;
+}
+
+static jsoff_t nprops(struct js *js, jsval_t obj, jsoff_t *bytes)
+{
+    jsoff_t n = has_slots(js, obj) ? shapelen(js, objshape(js, obj)) : 0;
+    for (jsoff_t off = loadoff(js, (jsoff_t)vdata(obj)) & ~3U; off != 0; off = loadoff(js, off) & ~3U) {
+        *bytes += esize(T_PROP);
+        n++;
+    }
+    return n;
+}
+
+void js_dump_heap(struct js *js)
+{
+    static const char *names[] = {"object", "prop", "string", "blob", "dead"};
+    jsoff_t count[5] = {0}, bytes[5] = {0}, dcount[4] = {0}, dbytes[4] = {0};
+    struct heaptop objs[HEAP_TOP], strs[HEAP_TOP];
+    memset(objs, 0, sizeof(objs));
+    memset(strs, 0, sizeof(strs));
+    for (jsoff_t off = 0, size = 0; off < js->brk; off += size) {
+        jsoff_t h = loadoff(js, off);
+        jsoff_t kind = (h & E_DEAD) ? 4 : (h & 3U);
+        size = esize(h);
+        if (kind == T_OBJ && has_slots(js, mkval(T_OBJ, off))) {
+            size += esize(loadoff(js, slotblob(mkval(T_OBJ, off))));
+        }
+        count[kind]++;
+        bytes[kind] += size;
+        if (kind == 4) {
+            dcount[h & 3U]++;
+            dbytes[h & 3U] += size;
+        } else if (kind == T_OBJ) {
+            jsoff_t total = size;
+            nprops(js, mkval(T_OBJ, off), &total);
+            topadd(objs, off, total);
+        } else if (kind == T_STR) {
+            topadd(strs, off, size);
+        }
+    }
+    printf("heap brk %u of %u, free list reuse %u\n", (unsigned)js->brk, (unsigned)js->size,
+        (unsigned)js->nreuse);
+    for (int i = 0; i < 5; i++) {
+        printf("  %-6s %8u entities %10u bytes\n", names[i], (unsigned)count[i], (unsigned)bytes[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        printf("    dead %-6s %8u entities %10u bytes\n", names[i], (unsigned)dcount[i], (unsigned)dbytes[i]);
+    }
+    for (int i = 0; i < HEAP_TOP && objs[i].size != 0; i++) {
+        jsoff_t total = 0;
+        jsoff_t n = nprops(js, mkval(T_OBJ, objs[i].off), &total);
+        printf("  object @%u %u props %u bytes\n", (unsigned)objs[i].off, (unsigned)n,
+            (unsigned)objs[i].size);
+    }
+    for (int i = 0; i < HEAP_TOP && strs[i].size != 0; i++) {
+        jsoff_t len = offtolen(loadoff(js, strs[i].off));
+        printf("  string @%u len %u \"%.*s\"\n", (unsigned)strs[i].off, (unsigned)len,
+            (int)(len < 16 ? len : 16), (const char *)&js->mem[strs[i].off + sizeof(jsoff_t)]);
+    }
+    if (js->prof != 0) {
+        js_dump_allocs(js);
+    }
+}
+
+/*
+    分配点统计：打开以后每次js_alloc按当前执行到的代码位置（js->code+js->toff）累计次数和字节数，
+    还没有执行过代码的时候算在NULL下面。统计的是分配的总量，不是还活着的量。
+    表是开放寻址的，满了以后新的分配点就不记了。
+*/
+#define JS_NALLOCS 64
+
+struct jsallocsite {
+    const char *pc;
+    jsoff_t toff;//pc在当时那段代码里面的offset
+    jsoff_t count;
+    jsoff_t bytes;
+    bool used;
+};
+
+static void profalloc(struct js *js, jsoff_t size)
+{
+    struct jsallocsite site;
+    //不在执行脚本的时候js->code和toff是上一次留下的，统一记到pc为NULL的宿主分配上
+    const char *pc = js->nrun > 0 && js->code != NULL ? &js->code[js->toff] : NULL;
+    jsoff_t h = (jsoff_t)(((uintptr_t)pc >> 1) % JS_NALLOCS);
+    for (jsoff_t i = 0; i < JS_NALLOCS; i++) {
+        jsoff_t off = js->prof + (jsoff_t)sizeof(jsoff_t) + ((h + i) % JS_NALLOCS) * (jsoff_t)sizeof(site);
+        memcpy(&site, &js->mem[off], sizeof(site));
+        if (site.used && site.pc != pc) {
+            continue;
+        }
+        site.used = true;
+        site.pc = pc;
+        site.toff = pc != NULL ? js->toff : 0;
+        site.count++;
+        site.bytes += size;
+        memcpy(&js->mem[off], &site, sizeof(site));
+        return;
+    }
+}
+
+bool js_profile_allocs(struct js *js, bool on)
+{
+    if (!on) {
+        js->prof = 0;
+        return true;
+    }
+    if (js->prof == 0) {
+        jsoff_t tab = mkblob(js, NULL, JS_NALLOCS * sizeof(struct jsallocsite));
+        if (tab == ~0U) {
+            return false;
+        }
+        memset(&js->mem[tab + sizeof(jsoff_t)], 0, JS_NALLOCS * sizeof(struct jsallocsite));
+        js->prof = tab;
+    }
+    return true;
+}
+
+void js_dump_allocs(struct js *js)
+{
+    struct jsallocsite sites[JS_NALLOCS], tmp;
+    int n = 0;
+    if (js->prof == 0) {
+        return;
+    }
+    for (int i = 0; i < JS_NALLOCS; i++) {
+        memcpy(&tmp, &js->mem[js->prof + sizeof(jsoff_t) + (jsoff_t)i * sizeof(tmp)], sizeof(tmp));
+        if (!tmp.used) {
+            continue;
+        }
+        int j = n++;
+        for (; j > 0 && sites[j - 1].bytes < tmp.bytes; j--) {
+            sites[j] = sites[j - 1];
+        }
+        sites[j] = tmp;
+    }
+    for (int i = 0; i < n && i < 10; i++) {
+        if (sites[i].pc == NULL) {
+            printf("  alloc site host allocs %u bytes %u\n",
+                (unsigned)sites[i].count, (unsigned)sites[i].bytes);
+            continue;
+        }
+        printf("  alloc site %p toff %u allocs %u bytes %u\n", (const void *)sites[i].pc,
+            (unsigned)sites[i].toff, (unsigned)sites[i].count, (unsigned)sites[i].bytes);
+    }
+}
+
+/*
+    脚本缓存：elk没有编译产物，执行完库脚本以后的arena就是它的结果。
+    所以缓存的是一个刚创建的js执行完这段代码以后的arena快照，
+    文件名是JS_VERSION加上代码的64位FNV hash，装载的时候mmap进来，
+    检查头部和内容的checksum，再拷贝回arena，不用再解析执行。
+    arena里面不能有宿主的指针（C函数、外部字符串、buffer），
+    所以只给刚创建、还没有注册过宿主函数的js用，其他情况直接执行不缓存。
+    site表里面的pc指向原来的代码，装载以后清空。
+*/
+#define CACHE_MAGIC 0x434b4c45U //"ELKC"
+
+struct jscache {
+    uint32_t magic;
+    uint32_t hdrsize;//sizeof(struct jscache)，结构体变了旧文件就作废
+    uint64_t key;//JS_VERSION和代码的hash
+    uint64_t sum;//头部（sum当作0）和arena内容的hash
+    uint64_t clen;
+    jsval_t res;
+    jsoff_t brk;
+    jsoff_t sites;
+    jsoff_t shapes;
+    jsoff_t nreuse;
+    jsoff_t freel[FREE_MAXSIZE / 4 + 1];
+};
+
+static uint64_t hash64(uint64_t h, const void *buf, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n-- > 0) {
+        h = (h ^ *p++) * 1099511628211ULL;//FNV-1a
+    }
+    return h;
+}
+
+static uint64_t cachesum(struct jscache c, const void *mem)
+{
+    c.sum = 0;
+    return hash64(hash64(14695981039346656037ULL, &c, sizeof(c)), mem, c.brk);
+}
+
+static bool is_fresh(struct js *js)
+{
+    return js->brk == esize(T_OBJ) && loadoff(js, 0) == T_OBJ && js->xstr == 0 &&
+        js->sites == 0 && js->shapes == 0 && js->prof == 0 && vdata(js->scope) == 0;
+}
+
+#ifdef JS_CACHE
+static void cachepath(char *path, size_t n, const char *dir, uint64_t key)
+{
+    snprintf(path, n, "%s/%016llx.elkc", dir, (unsigned long long)key);
+}
+
+static bool cacheload(struct js *js, const char *path, uint64_t key, size_t clen, jsval_t *res)
+{
+    struct stat st;
+    struct jscache c;
+    bool ok = false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(c)) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    memcpy(&c, p, sizeof(c));
+    const uint8_t *mem = (const uint8_t *)p + sizeof(c);
+    if (c.magic == CACHE_MAGIC && c.hdrsize == sizeof(c) && c.key == key && c.clen == clen &&
+        c.brk <= js->size && (size_t)st.st_size == sizeof(c) + c.brk && c.shapes < c.brk &&
+        (c.sites == 0 || c.sites + sizeof(jsoff_t) + JS_NSITES * sizeof(struct jssite) <= c.brk) &&
+        cachesum(c, mem) == c.sum) {
+        memcpy(js->mem, mem, c.brk);
+        js->brk = js->hwm = c.brk;
+        js->sites = c.sites;
+        js->shapes = c.shapes;
+        js->nreuse = c.nreuse;
+        memcpy(js->freel, c.freel, sizeof(js->freel));
+        if (js->sites != 0) {
+            memset(&js->mem[js->sites + sizeof(jsoff_t)], 0, JS_NSITES * sizeof(struct jssite));
+        }
+        *res = c.res;
+        ok = true;
+    }
+    munmap(p, (size_t)st.st_size);
+    return ok;
+}
+
+//先写临时文件再rename，别的进程不会读到写了一半的文件
+static void cachesave(struct js *js, const char *path, uint64_t key, size_t clen, jsval_t res)
+{
+    struct jscache c;
+    char tmp[512];
+    memset(&c, 0, sizeof(c));
+    c.magic = CACHE_MAGIC;
+    c.hdrsize = sizeof(c);
+    c.key = key;
+    c.clen = clen;
+    c.res = res;
+    c.brk = js->brk;
+    c.sites = js->sites == ~0U ? 0 : js->sites;
+    c.shapes = js->shapes == ~0U ? 0 : js->shapes;
+    c.nreuse = js->nreuse;
+    memcpy(c.freel, js->freel, sizeof(c.freel));
+    c.sum = cachesum(c, js->mem);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    bool ok = write(fd, &c, sizeof(c)) == (ssize_t)sizeof(c) &&
+        write(fd, js->mem, js->brk) == (ssize_t)js->brk;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+#endif
+
+jsval_t js_eval_cached(struct js *js, const char *dir, const char *buf, size_t len)
 {
-    jsval_t res = js_mkundef();
     if (len == (size_t)~0U) {
         len = strlen(buf);
     }
+#ifdef JS_CACHE
+    char path[480];
+    jsval_t res = js_mkundef();
+    if (dir == NULL || !is_fresh(js)) {
+        return js_eval(js, buf, len);
+    }
+    uint64_t key = hash64(hash64(14695981039346656037ULL, JS_VERSION, sizeof(JS_VERSION)), buf, len);
+    cachepath(path, sizeof(path), dir, key);
+    if (cacheload(js, path, key, len, &res)) {
+        js->code = buf;
+        js->clen = (jsoff_t)len;
+        js->pos = (jsoff_t)len;
+        return res;
+    }
+    res = js_eval(js, buf, len);
+    uint8_t t = vtype(res);
+    if (!is_err(res) && !js_suspended(js) && js->xstr == 0 && t != T_CFUNC && t != T_VIEW) {
+        cachesave(js, path, key, len, res);
+    }
+    return res;
+#else
+    (void)dir;
+    return js_eval(js, buf, len);
+#endif
+}
+
+/*
+    实例池：先用init把每个实例准备好（注册宿主函数、加载库脚本），记下mark，
+    归还的时候js_reset退回到mark，只清掉mark到brk最高位置之间、还有参数区用过的内存。
+    借出去的时候对mark之前的全局变量和对象的改写记在undo log里面，js_reset的时候撤销。
+    池和所有实例都放在调用者给的buf里面，不是线程安全的，每个线程用自己的池。
+*/
+void js_mark(struct js *js)
+{
+    mark(js, &js->base);
+    js->hwm = js->brk;
+}
+
+void js_reset(struct js *js)
+{
+    rollback(js, &js->base);
+    if (js->hwm > js->brk) {
+        memset(&js->mem[js->brk], 0, js->hwm - js->brk);//上一次用过的数据不要留给下一次
+    }
+    memset(&js->mem[js->argmin], 0, js->size - js->argmin);//参数区也一样
+    js->hwm = js->brk;
+    js->argmin = js->size;
+    js->flags = 0;
+    js->code = NULL;
+    js->clen = js->pos = js->toff = js->tlen = 0;
     js->consumed = 1;
     js->tok = TOK_ERR;
-    js->code = buf;
-    js->clen = (jsoff_t)len;
-    js->pos = 0;
-    js->cstk = &res;//为什么指向这个？因为是C栈的第一个局部变量。
-    while (next(js) != TOK_EOF && !is_err(res)) {
-        res = js_stmt(js);
+    js->nogc = 0;
+    js->errmsg[0] = '\0';
+}
+
+struct jspool {
+    size_t size;//每个实例的字节数
+    size_t n;
+    size_t nfree;
+    struct js **free;//空闲实例的栈
+    uint8_t *arena;//n个实例连续放
+    uint8_t *busy;//每个实例一个字节，1表示已经借出去了
+};
+
+struct jspool *js_pool_create(void *buf, size_t len, size_t size, void (*init)(struct js *))
+{
+    struct jspool *pool = (struct jspool *)buf;
+    size = size / 8U * 8U;
+    if (len < sizeof(*pool) || size < sizeof(struct js) + esize(T_OBJ)) {
+        return NULL;
+    }
+    size_t n = (len - sizeof(*pool)) / (size + sizeof(struct js *) + 1U);
+    if (n == 0) {
+        return NULL;
     }
-}
\ No newline at end of file
+    pool->size = size;
+    pool->n = pool->nfree = n;
+    pool->free = (struct js **)(pool + 1);
+    pool->arena = (uint8_t *)(pool->free + n);
+    pool->busy = pool->arena + n * size;
+    memset(pool->busy, 0, n);
+    for (size_t i = 0; i < n; i++) {
+        struct js *js = js_create(pool->arena + i * size, size);
+        if (init != NULL) {
+            init(js);
+        }
+        js_mark(js);
+        pool->free[n - 1 - i] = js;
+    }
+    return pool;
+}
+
+//js在pool里面的下标，不是pool里面的实例返回n
+static size_t poolidx(struct jspool *pool, struct js *js)
+{
+    uintptr_t off = (uintptr_t)js - (uintptr_t)pool->arena;
+    if ((uintptr_t)js < (uintptr_t)pool->arena || off >= pool->n * pool->size || off % pool->size != 0) {
+        return pool->n;
+    }
+    return off / pool->size;
+}
+
+struct js *js_pool_acquire(struct jspool *pool)
+{
+    if (pool->nfree == 0) {
+        return NULL;
+    }
+    struct js *js = pool->free[--pool->nfree];
+    pool->busy[poolidx(pool, js)] = 1;
+    return js;
+}
+
+bool js_pool_release(struct jspool *pool, struct js *js)
+{
+    size_t i = js == NULL ? pool->n : poolidx(pool, js);
+    if (i >= pool->n || !pool->busy[i]) {
+        return false;//不是这个pool的，或者已经还过了
+    }
+    pool->busy[i] = 0;
+    js_reset(js);
+    pool->free[pool->nfree++] = js;
+    return true;
+}
@@ -7,9 +7,81 @@
 #include <stdint.h>
 
 struct js;
+struct jspool;
 typedef uint64_t jsval_t;
 
+//js_mkbuffer_external的元素类型
+enum { JS_UINT8, JS_INT32, JS_FLOAT64 };
+
 struct js *js_create(void *buf, size_t len);
 jsval_t js_mkerr(struct js *js, const char *xx, ...);
+jsval_t js_eval(struct js *js, const char *buf, size_t len);
+//宿主函数返回js_mkpending()会挂起脚本，js_eval/js_resume返回以后用js_suspended判断，
+//等结果到了再调js_resume继续。挂起期间传给js_eval的代码必须一直有效。
+jsval_t js_mkpending(struct js *js);
+bool js_suspended(struct js *js);
+jsval_t js_resume(struct js *js, jsval_t val);
+//和js_eval一样，但是在dir下面缓存执行完以后的arena，下次直接装载。
+//只对刚创建的js有效（先加载库脚本，再注册宿主函数），其他情况就是js_eval。
+jsval_t js_eval_cached(struct js *js, const char *dir, const char *buf, size_t len);
+
+//js_mark记下当前的状态，js_reset退回去，mark之后对mark之前的全局变量和对象的修改也会撤销。
+//js_create以后已经mark过一次。
+void js_mark(struct js *js);
+void js_reset(struct js *js);
+//buf里面放下尽量多个size大小的实例，每个先调init再mark，release的时候js_reset。
+//release的js不是从这个pool借出去的、或者已经还过了，返回false。
+struct jspool *js_pool_create(void *buf, size_t len, size_t size, void (*init)(struct js *));
+struct js *js_pool_acquire(struct jspool *pool);
+bool js_pool_release(struct jspool *pool, struct js *js);
+void js_stats(struct js *js, size_t *total, size_t *brk, size_t *freeb, size_t *reused);
+jsval_t js_mkundef(void);
+jsval_t js_mknum(double value);
+double js_getnum(jsval_t value);
+bool js_isfunc(jsval_t value);
+bool js_iserr(jsval_t value);
+jsval_t js_mkfun(jsval_t (*fn)(struct js *, jsval_t *, int));
+jsval_t js_glob(struct js *js);
+const char *js_errmsg(struct js *js);
+void js_setuserdata(struct js *js, void *udata);
+void *js_getuserdata(struct js *js);
+//js函数递归最多用多少字节的C栈，超过了报错"C stack"，0表示不限制。默认1M，线程的栈比这个小要改小。
+void js_setmaxcss(struct js *js, size_t max);
+//宿主调用函数，args里面的前nargs个值直接绑定到参数上，多出来的参数是undefined
+jsval_t js_call(struct js *js, jsval_t func, const jsval_t *args, int nargs);
+jsval_t js_mkobj(struct js *js);
+jsval_t js_mkstr(struct js *js, const void *ptr, size_t len);
+jsval_t js_set(struct js *js, jsval_t obj, const char *key, jsval_t val);
+jsval_t js_get(struct js *js, jsval_t obj, const char *key);
+jsval_t js_mkstr_external(struct js *js, const char *ptr, size_t len, void (*release)(void *));
+const char *js_getstr(struct js *js, jsval_t value, size_t *len);
+void js_release_externals(struct js *js);
+void js_dump_sites(struct js *js);
+void js_dump_heap(struct js *js);
+bool js_profile_allocs(struct js *js, bool on);
+void js_dump_allocs(struct js *js);
+//打开或者关闭JIT（只有linux x86-64），返回打开了没有。不允许可执行内存的宿主返回false。
+//打开过JIT的js不用以前要js_jit(js, false)，否则可执行内存不会释放。
+bool js_jit(struct js *js, bool on);
+void js_dump_jit(struct js *js);
+
+jsval_t js_mkarr(struct js *js);
+size_t js_arr_len(struct js *js, jsval_t arr);
+jsval_t js_arr_get(struct js *js, jsval_t arr, size_t idx);
+jsval_t js_arr_set(struct js *js, jsval_t arr, size_t idx, jsval_t val);
+jsval_t js_arr_push(struct js *js, jsval_t arr, const jsval_t *vals, size_t n);
+jsval_t js_arr_slice(struct js *js, jsval_t arr, size_t start, size_t end);
+jsval_t js_mkbuffer_external(struct js *js, void *ptr, size_t len, int type);
+jsval_t js_numlib(struct js *js);
+//关掉的话num的函数只用标量的实现（所有的js都一样），返回现在是不是在用SIMD
+bool js_numlib_simd(bool on);
+
+jsval_t js_json_parse(struct js *js, const char *buf, size_t len);
+size_t js_json_stringify(struct js *js, jsval_t val, char *out, size_t len);
+
+//recs是n条JSON记录，lens为NULL时用strlen。每条记录绑定到全局变量name，执行rule，
+//结果放到out[i]，返回出错的记录条数。rule对调用之前就有的变量和对象的修改，每条记录结束时撤销。
+size_t js_batch(struct js *js, const char *name, const char *rule, size_t rlen,
+    const char *const *recs, const size_t *lens, size_t n, jsval_t *out);
 
 #endif
@@ -0,0 +1,419 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "loop.h"
+#include "mylog.h"
+
+#define LOOP_MAXEVENTS 64
+#define TIMER_MAXMS 2147483647.0 //和浏览器一样，再大的延时按这个算
+
+struct jstimer {
+    uint64_t when;//到期的时间，CLOCK_MONOTONIC的纳秒
+    uint64_t every;//setInterval的周期，0表示只执行一次
+    uint32_t id;
+    struct js *js;
+    jsval_t fn;
+};
+
+struct jswatch {
+    int fd;
+    struct js *js;//NULL表示已经unwatch，这一轮事件处理完再释放
+    jsval_t fn;
+    struct jswatch *next;
+};
+
+struct jstask {
+    struct js *js;//NULL表示js已经从loop里面去掉了
+    jsval_t fn;
+};
+
+struct jsloop {
+    int epfd;
+    int tfd;//所有的定时器共用一个timerfd，设置成最早到期的那个
+    uint64_t armed;//timerfd当前的到期时间，0表示没有设置
+    struct jstimer *timers;//按when排的最小堆
+    size_t ntimers;
+    size_t tcap;
+    struct jswatch *watches;
+    size_t nwatch;//还有效的watch个数
+    struct jstask *tasks;
+    size_t ntasks;
+    size_t kcap;
+    uint32_t nextid;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void swaptimer(struct jstimer *a, struct jstimer *b)
+{
+    struct jstimer t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void heapup(struct jstimer *h, size_t i)
+{
+    while (i > 0 && h[(i - 1) / 2].when > h[i].when) {
+        swaptimer(&h[(i - 1) / 2], &h[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heapdown(struct jstimer *h, size_t n, size_t i)
+{
+    for (;;) {
+        size_t l = i * 2 + 1, r = l + 1, m = i;
+        if (l < n && h[l].when < h[m].when) {
+            m = l;
+        }
+        if (r < n && h[r].when < h[m].when) {
+            m = r;
+        }
+        if (m == i) {
+            return;
+        }
+        swaptimer(&h[m], &h[i]);
+        i = m;
+    }
+}
+
+static bool heappush(struct jsloop *loop, const struct jstimer *t)
+{
+    if (loop->ntimers == loop->tcap) {
+        size_t cap = loop->tcap > 0 ? loop->tcap * 2 : 16;
+        struct jstimer *p = realloc(loop->timers, cap * sizeof(*p));
+        if (p == NULL) {
+            return false;
+        }
+        loop->timers = p;
+        loop->tcap = cap;
+    }
+    loop->timers[loop->ntimers] = *t;
+    heapup(loop->timers, loop->ntimers++);
+    return true;
+}
+
+static void heapdel(struct jsloop *loop, size_t i)
+{
+    loop->timers[i] = loop->timers[--loop->ntimers];
+    if (i < loop->ntimers) {
+        heapdown(loop->timers, loop->ntimers, i);
+        heapup(loop->timers, i);
+    }
+}
+
+//timerfd设置到最早的定时器，没有定时器就关掉
+static void rearm(struct jsloop *loop)
+{
+    struct itimerspec its;
+    uint64_t when = loop->ntimers > 0 ? loop->timers[0].when : 0;
+    if (when == loop->armed) {
+        return;
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(when / 1000000000ULL);
+    its.it_value.tv_nsec = (long)(when % 1000000000ULL);
+    timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    loop->armed = when;
+}
+
+static const jsval_t noargs[1];//定时器和microtask的回调没有参数
+
+static void run(struct js *js, jsval_t fn, const jsval_t *args, int nargs)
+{
+    jsval_t res = js_call(js, fn, args, nargs);
+    if (js_iserr(res)) {
+        myloge("callback: %s", js_errmsg(js));
+    }
+}
+
+//microtask批量执行，执行过程中新加的也在这一批里面
+static void drain(struct jsloop *loop)
+{
+    for (size_t i = 0; i < loop->ntasks; i++) {
+        struct jstask t = loop->tasks[i];
+        if (t.js != NULL) {
+            run(t.js, t.fn, noargs, 0);
+        }
+    }
+    loop->ntasks = 0;
+}
+
+static void firetimers(struct jsloop *loop)
+{
+    uint64_t expirations = 0, t = now_ns();
+    if (read(loop->tfd, &expirations, sizeof(expirations)) < 0) {
+        //非阻塞的，没有到期也没关系
+    }
+    loop->armed = 0;
+    //回调里面加的0延时定时器when比t大，留到下一轮，不会饿死fd
+    while (loop->ntimers > 0 && loop->timers[0].when <= t) {
+        struct jstimer tm = loop->timers[0];
+        if (tm.every > 0) {
+            loop->timers[0].when = tm.when + tm.every > t ? tm.when + tm.every : t + tm.every;
+            heapdown(loop->timers, loop->ntimers, 0);
+        } else {
+            heapdel(loop, 0);
+        }
+        run(tm.js, tm.fn, noargs, 0);
+        drain(loop);
+    }
+    rearm(loop);
+}
+
+static void dropwatch(struct jsloop *loop, struct jswatch *w)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    w->js = NULL;
+    loop->nwatch--;
+}
+
+//释放已经unwatch的，epoll_wait返回的事件里面可能还指着它们，所以不能马上释放
+static void reap(struct jsloop *loop)
+{
+    struct jswatch **pw = &loop->watches;
+    while (*pw != NULL) {
+        struct jswatch *w = *pw;
+        if (w->js == NULL) {
+            *pw = w->next;
+            free(w);
+        } else {
+            pw = &w->next;
+        }
+    }
+}
+
+static jsval_t addtimer(struct js *js, jsval_t *args, int nargs, bool repeat)
+{
+    struct jsloop *loop = js_getuserdata(js);
+    struct jstimer t;
+    if (nargs < 1 || !js_isfunc(args[0])) {
+        return js_mkerr(js, "bad args");
+    }
+    double ms = nargs > 1 ? js_getnum(args[1]) : 0;
+    ms = ms >= 0 ? fmin(ms, TIMER_MAXMS) : 0;
+    if (repeat && ms < 1) {
+        ms = 1;//setInterval(fn, 0)不要空转
+    }
+    t.every = repeat ? (uint64_t)(ms * 1e6) : 0;
+    t.when = now_ns() + (uint64_t)(ms * 1e6);
+    t.id = ++loop->nextid == 0 ? ++loop->nextid : loop->nextid;
+    t.js = js;
+    t.fn = args[0];
+    if (!heappush(loop, &t)) {
+        return js_mkerr(js, "oom");
+    }
+    rearm(loop);
+    return js_mknum(t.id);
+}
+
+static jsval_t l_settimeout(struct js *js, jsval_t *args, int nargs)
+{
+    return addtimer(js, args, nargs, false);
+}
+
+static jsval_t l_setinterval(struct js *js, jsval_t *args, int nargs)
+{
+    return addtimer(js, args, nargs, true);
+}
+
+static jsval_t l_cleartimeout(struct js *js, jsval_t *args, int nargs)
+{
+    struct jsloop *loop = js_getuserdata(js);
+    double id = nargs > 0 ? js_getnum(args[0]) : NAN;
+    for (size_t i = 0; i < loop->ntimers; i++) {
+        if (loop->timers[i].js == js && loop->timers[i].id == id) {
+            heapdel(loop, i);
+            rearm(loop);
+            break;
+        }
+    }
+    return js_mkundef();
+}
+
+static jsval_t l_queuemicrotask(struct js *js, jsval_t *args, int nargs)
+{
+    struct jsloop *loop = js_getuserdata(js);
+    if (nargs < 1 || !js_isfunc(args[0])) {
+        return js_mkerr(js, "bad args");
+    }
+    if (loop->ntasks == loop->kcap) {
+        size_t cap = loop->kcap > 0 ? loop->kcap * 2 : 16;
+        struct jstask *p = realloc(loop->tasks, cap * sizeof(*p));
+        if (p == NULL) {
+            return js_mkerr(js, "oom");
+        }
+        loop->tasks = p;
+        loop->kcap = cap;
+    }
+    loop->tasks[loop->ntasks].js = js;
+    loop->tasks[loop->ntasks++].fn = args[0];
+    return js_mkundef();
+}
+
+static jsval_t l_watch(struct js *js, jsval_t *args, int nargs)
+{
+    struct jsloop *loop = js_getuserdata(js);
+    struct epoll_event ev;
+    double d = nargs > 0 ? js_getnum(args[0]) : NAN;
+    if (nargs < 2 || !js_isfunc(args[1]) || !(d >= 0 && d <= 2147483647.0) || d != (int)d) {
+        return js_mkerr(js, "bad args");
+    }
+    struct jswatch *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return js_mkerr(js, "oom");
+    }
+    w->fd = (int)d;
+    w->js = js;
+    w->fn = args[1];
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, w->fd, &ev) != 0) {
+        free(w);
+        return js_mkerr(js, "watch %d failed", (int)d);
+    }
+    w->next = loop->watches;
+    loop->watches = w;
+    loop->nwatch++;
+    return js_mknum(d);
+}
+
+static jsval_t l_unwatch(struct js *js, jsval_t *args, int nargs)
+{
+    struct jsloop *loop = js_getuserdata(js);
+    double d = nargs > 0 ? js_getnum(args[0]) : NAN;
+    for (struct jswatch *w = loop->watches; w != NULL; w = w->next) {
+        if (w->js == js && w->fd == d) {
+            dropwatch(loop, w);
+            break;
+        }
+    }
+    return js_mkundef();
+}
+
+struct jsloop *js_loop_create(void)
+{
+    struct epoll_event ev;
+    struct jsloop *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;//NULL表示timerfd
+    if (loop->epfd < 0 || loop->tfd < 0 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev) != 0) {
+        myloge("epoll/timerfd init fail");
+        js_loop_destroy(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void js_loop_destroy(struct jsloop *loop)
+{
+    if (loop == NULL) {
+        return;
+    }
+    for (struct jswatch *w = loop->watches; w != NULL; w = w->next) {
+        w->js = NULL;
+    }
+    reap(loop);
+    if (loop->tfd >= 0) {
+        close(loop->tfd);
+    }
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+    }
+    free(loop->timers);
+    free(loop->tasks);
+    free(loop);
+}
+
+jsval_t js_loop_add(struct jsloop *loop, struct js *js)
+{
+    static const struct {
+        const char *name;
+        jsval_t (*fn)(struct js *, jsval_t *, int);
+    } fns[] = {
+        {"setTimeout", l_settimeout}, {"setInterval", l_setinterval},
+        {"clearTimeout", l_cleartimeout}, {"clearInterval", l_cleartimeout},
+        {"queueMicrotask", l_queuemicrotask}, {"watch", l_watch}, {"unwatch", l_unwatch},
+    };
+    js_setuserdata(js, loop);
+    for (size_t i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+        jsval_t res = js_set(js, js_glob(js), fns[i].name, js_mkfun(fns[i].fn));
+        if (js_iserr(res)) {
+            return res;
+        }
+    }
+    return js_mkundef();
+}
+
+void js_loop_remove(struct jsloop *loop, struct js *js)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < loop->ntimers; i++) {
+        if (loop->timers[i].js != js) {
+            loop->timers[n++] = loop->timers[i];
+        }
+    }
+    loop->ntimers = n;
+    for (size_t i = n / 2; i-- > 0;) {
+        heapdown(loop->timers, n, i);
+    }
+    rearm(loop);
+    for (struct jswatch *w = loop->watches; w != NULL; w = w->next) {
+        if (w->js == js) {
+            dropwatch(loop, w);
+        }
+    }
+    for (size_t i = 0; i < loop->ntasks; i++) {
+        if (loop->tasks[i].js == js) {
+            loop->tasks[i].js = NULL;
+        }
+    }
+    js_setuserdata(js, NULL);
+}
+
+int js_loop_step(struct jsloop *loop, int timeout_ms)
+{
+    struct epoll_event evs[LOOP_MAXEVENTS];
+    drain(loop);//宿主js_eval的时候放进来的
+    if (loop->ntimers == 0 && loop->nwatch == 0) {
+        return 0;
+    }
+    int n = epoll_wait(loop->epfd, evs, LOOP_MAXEVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        struct jswatch *w = evs[i].data.ptr;
+        if (w == NULL) {
+            firetimers(loop);
+        } else if (w->js != NULL) {
+            jsval_t arg = js_mknum(w->fd);
+            run(w->js, w->fn, &arg, 1);
+            drain(loop);
+        }
+    }
+    reap(loop);
+    return (int)(loop->ntimers + loop->nwatch + loop->ntasks);
+}
+
+void js_loop_run(struct jsloop *loop)
+{
+    while (js_loop_step(loop, -1) > 0) {
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef _loop_h_
+#define _loop_h_
+
+#include "elk.h"
+
+/*
+    可选的事件循环，基于epoll和timerfd，只能在linux上用。
+    一个loop可以挂很多个js，都在调用js_loop_run的那个线程里面执行。
+    js里面可以用：
+        setTimeout(fn, ms) / setInterval(fn, ms) 返回id
+        clearTimeout(id) / clearInterval(id)
+        queueMicrotask(fn) 当前回调结束以后马上执行
+        watch(fd, fn) fd可读的时候调用fn(fd)，水平触发，fn要把数据读掉或者unwatch
+        unwatch(fd)
+*/
+struct jsloop;
+
+struct jsloop *js_loop_create(void);
+void js_loop_destroy(struct jsloop *loop);
+//注册上面的函数，js的userdata会被loop占用
+jsval_t js_loop_add(struct jsloop *loop, struct js *js);
+//去掉js的定时器、fd和还没执行的microtask，之后js可以reset或者释放
+void js_loop_remove(struct jsloop *loop, struct js *js);
+//处理一轮事件，最多等timeout_ms毫秒，-1表示一直等。返回还在等的定时器、fd和microtask个数
+int js_loop_step(struct jsloop *loop, int timeout_ms);
+//一直执行到没有定时器和fd
+void js_loop_run(struct jsloop *loop);
+
+#endif
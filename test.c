@@ -1,7 +1,50 @@
 
 
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "elk.h"
+#ifdef __linux__
+#include "loop.h"
+#endif
 #include "mylog.h"
+
+static int nfail;
+
+//执行code，结果转成JSON和want比较
+static void check(struct js *js, const char *code, const char *want)
+{
+    char out[200];
+    jsval_t v = js_eval(js, code, strlen(code));
+    if (js_iserr(v)) {
+        snprintf(out, sizeof(out), "%s", js_errmsg(js));
+    } else if (js_json_stringify(js, v, out, sizeof(out)) == 0) {
+        snprintf(out, sizeof(out), "?");
+    }
+    if (strcmp(out, want) != 0) {
+        myloge("%s: got %s, want %s", code, out, want);
+        nfail++;
+    }
+}
+//把fn打到stdout的内容收到buf里面
+static void capture(void (*fn)(struct js *), struct js *js, char *buf, size_t len)
+{
+    FILE *f = tmpfile();
+    fflush(stdout);
+    int fd = dup(1);
+    dup2(fileno(f), 1);
+    fn(js);
+    fflush(stdout);
+    dup2(fd, 1);
+    close(fd);
+    rewind(f);
+    buf[fread(buf, 1, len - 1, f)] = '\0';
+    fclose(f);
+}
+
 static void test_basic()
 {
     struct js *js;
@@ -17,8 +60,1096 @@ static void test_basic()
     // printf("result:%s", result);
 }
 
-int main(int argc, char const *argv[])
+static void test_json()
+{
+    struct js *js;
+    char mem[2000];
+    char out[200];
+    js = js_create(mem, sizeof(mem));
+    const char *json = "{\"a\":1,\"b\":[true,null],\"c\":\"x\\ty\"}";
+    jsval_t v = js_json_parse(js, json, strlen(json));
+    js_json_stringify(js, v, out, sizeof(out));
+    if (strcmp(out, "{\"a\":1,\"b\":[true,null],\"c\":\"x\\ty\"}") != 0) {
+        myloge("json round trip fail: %s", out);
+        nfail++;
+    }
+    //溢出的数字是Infinity，输出null，不能变成全局对象
+    json = "[1e400,-1e400]";
+    v = js_json_parse(js, json, strlen(json));
+    js_json_stringify(js, v, out, sizeof(out));
+    if (strcmp(out, "[null,null]") != 0) {
+        myloge("json overflow fail: %s", out);
+        nfail++;
+    }
+}
+
+static void test_arr()
+{
+    struct js *js;
+    static char mem[8192];
+    char out[200];
+    jsval_t v[8];
+    js = js_create(mem, sizeof(mem));
+    jsval_t a = js_mkarr(js);
+    //写到len后面，中间的空位是undefined，输出成null
+    js_arr_set(js, a, 3, js_mknum(7));
+    js_json_stringify(js, a, out, sizeof(out));
+    if (js_arr_len(js, a) != 4 || strcmp(out, "[null,null,null,7]") != 0) {
+        myloge("arr set past length: %d %s", (int)js_arr_len(js, a), out);
+        nfail++;
+    }
+    //一个一个push，扩容几次以后前面的元素还在
+    jsval_t b = js_mkarr(js);
+    for (int i = 0; i < 100; i++) {
+        v[0] = js_mknum(i);
+        js_arr_push(js, b, v, 1);
+    }
+    for (int i = 0; i < 8; i++) {
+        v[i] = js_mknum(100 + i);
+    }
+    js_arr_push(js, b, v, 8);
+    if (js_arr_len(js, b) != 108) {
+        myloge("arr push len %d", (int)js_arr_len(js, b));
+        nfail++;
+    }
+    for (int i = 0; i < 108; i++) {
+        if (js_getnum(js_arr_get(js, b, (size_t)i)) != i) {
+            myloge("arr push lost element %d", i);
+            nfail++;
+            break;
+        }
+    }
+    if (js_arr_get(js, b, 108) != js_mkundef()) {
+        myloge("arr get past length is not undefined");
+        nfail++;
+    }
+    //slice的范围超出长度的时候截断，start大于end的时候是空数组
+    js_json_stringify(js, js_arr_slice(js, b, 105, 1000), out, sizeof(out));
+    if (strcmp(out, "[105,106,107]") != 0) {
+        myloge("arr slice clamp: %s", out);
+        nfail++;
+    }
+    js_json_stringify(js, js_arr_slice(js, b, 50, 10), out, sizeof(out));
+    if (strcmp(out, "[]") != 0) {
+        myloge("arr slice empty: %s", out);
+        nfail++;
+    }
+    js_json_stringify(js, js_arr_slice(js, b, 200, 300), out, sizeof(out));
+    if (strcmp(out, "[]") != 0) {
+        myloge("arr slice past end: %s", out);
+        nfail++;
+    }
+    js_set(js, js_glob(js), "b", b);
+    check(js, "b.length", "108");
+}
+
+static void test_view()
+{
+    struct js *js;
+    static char mem[4096];
+    uint8_t u8[4] = {0};
+    int32_t i32[2] = {0};
+    double f64[2] = {0};
+    js = js_create(mem, sizeof(mem));
+    jsval_t vu = js_mkbuffer_external(js, u8, sizeof(u8), JS_UINT8);
+    jsval_t vi = js_mkbuffer_external(js, i32, sizeof(i32), JS_INT32);
+    jsval_t vf = js_mkbuffer_external(js, f64, sizeof(f64), JS_FLOAT64);
+    //写进去的时候按2^32取模再截断，和Uint8Array/Int32Array一样
+    js_arr_set(js, vu, 0, js_mknum(257));
+    js_arr_set(js, vu, 1, js_mknum(-1));
+    js_arr_set(js, vu, 2, js_mknum(3.9));
+    js_arr_set(js, vi, 0, js_mknum(2147483648.0));
+    js_arr_set(js, vi, 1, js_mknum(-4294967297.0));
+    if (u8[0] != 1 || u8[1] != 255 || u8[2] != 3 || i32[0] != INT32_MIN || i32[1] != -1) {
+        myloge("view wrap: %u %u %u %d %d", u8[0], u8[1], u8[2], (int)i32[0], (int)i32[1]);
+        nfail++;
+    }
+    if (js_getnum(js_arr_get(js, vu, 1)) != 255 || js_getnum(js_arr_get(js, vi, 0)) != INT32_MIN) {
+        myloge("view read back");
+        nfail++;
+    }
+    //double原样进出，host那边改了js马上能看到
+    js_arr_set(js, vf, 0, js_mknum(0.1));
+    f64[1] = -1e-300;
+    if (f64[0] != 0.1 || js_getnum(js_arr_get(js, vf, 1)) != -1e-300) {
+        myloge("view float64 round trip");
+        nfail++;
+    }
+    //越界读是undefined，越界写不改host的内存
+    js_arr_set(js, vu, 4, js_mknum(9));
+    js_arr_set(js, vi, 100, js_mknum(9));
+    if (js_arr_get(js, vu, 4) != js_mkundef() || js_arr_get(js, vf, 2) != js_mkundef() ||
+        js_arr_len(js, vu) != 4 || js_arr_len(js, vi) != 2 || u8[3] != 0) {
+        myloge("view out of range");
+        nfail++;
+    }
+    js_set(js, js_glob(js), "vf", vf);
+    check(js, "vf.length", "2");
+    check(js, "typeof vf", "\"typedarray\"");
+}
+
+static int nrelease;
+
+static void xrelease(void *p)
+{
+    (void)p;
+    nrelease++;
+}
+
+static void test_xstr()
+{
+    struct js *js;
+    static char mem[4096];
+    static char out[2048];
+    char body[] = "hello";
+    size_t len = 0;
+    unsigned nblob0, nblob1, bytes;
+    js = js_create(mem, sizeof(mem));
+    //js_getstr直接返回host的指针，不拷贝
+    jsval_t s = js_mkstr_external(js, body, 5, xrelease);
+    if (js_getstr(js, s, &len) != body || len != 5) {
+        myloge("xstr getstr");
+        nfail++;
+    }
+    js_set(js, js_glob(js), "s", s);
+    check(js, "let c = s + \"!\"; c", "\"hello!\"");
+    check(js, "s === \"hello\"", "true");
+    //拼接的结果在arena里面，host改了内存只影响外部字符串本身
+    body[0] = 'j';
+    check(js, "s", "\"jello\"");
+    check(js, "c", "\"hello!\"");
+    //census里面外部字符串是一个blob，不算host的字节
+    capture(js_dump_heap, js, out, sizeof(out));
+    const char *p = strstr(out, "  blob ");
+    if (p == NULL || sscanf(p, "  blob %u entities %u bytes", &nblob0, &bytes) != 2) {
+        myloge("xstr census\n%s", out);
+        nfail++;
+        return;
+    }
+    js_mkstr_external(js, out, 1000, NULL);
+    capture(js_dump_heap, js, out, sizeof(out));
+    p = strstr(out, "  blob ");
+    if (p == NULL || sscanf(p, "  blob %u entities %u bytes", &nblob1, &bytes) != 2 ||
+        nblob1 != nblob0 + 1 || strstr(out, "len 1000") != NULL) {
+        myloge("xstr census count\n%s", out);
+        nfail++;
+    }
+    //mark之后建的外部字符串reset的时候release，之前的留着
+    js_mark(js);
+    js_mkstr_external(js, body, 5, xrelease);
+    js_mkstr_external(js, body, 5, xrelease);
+    js_reset(js);
+    if (nrelease != 2) {
+        myloge("xstr release on reset: %d", nrelease);
+        nfail++;
+    }
+    check(js, "s", "\"jello\"");
+    js_release_externals(js);
+    js_release_externals(js);
+    if (nrelease != 3) {
+        myloge("xstr release: %d", nrelease);
+        nfail++;
+    }
+}
+
+static void test_call()
+{
+    struct js *js;
+    static char mem[4096];
+    js = js_create(mem, sizeof(mem));
+    //参数在调用方的scope里面计算，不能看到被调函数的同名参数
+    check(js, "let x=5; let r=0; let f=function(x,y){r=y;}; f(1,x); r", "5");
+    check(js, "f(x+1, x); r", "5");
+    check(js, "let m=function(a,b){return a*b; r=0;}; m(3,4) + r", "17");
+    check(js, "let k=function(n){return n>1 ? n*k(n-1) : 1;}; k(5)", "120");
+    check(js, "return 1", "ERROR: not in function");
+    //arena很大的时候无限递归先碰到maxcss，报错以后还能接着用
+    static char big[1 << 20];
+    js = js_create(big, sizeof(big));
+    check(js, "let f = function(n) { return f(n + 1); }; f(0)", "ERROR: C stack");
+    check(js, "let g = function(n) { return n === 0 ? 0 : g(n - 1) + 1; }; g(100)", "100");
+    js_setmaxcss(js, 16 * 1024);
+    check(js, "g(100)", "ERROR: C stack");
+    check(js, "g(2)", "2");
+}
+
+static void test_num()
+{
+    struct js *js;
+    static char mem[4096];
+    char out[256];
+    js = js_create(mem, sizeof(mem));
+    //+Infinity的位和装箱的全局对象不能一样
+    check(js, "typeof(1/0)", "\"number\"");
+    check(js, "typeof(-1/0)", "\"number\"");
+    check(js, "typeof(1e308*10)", "\"number\"");
+    check(js, "1e308*10 === 1/0", "true");
+    check(js, "-1/0 < -1e308", "true");
+    check(js, "let o=1/0; o.p=5", "ERROR: lookup in non-obj");
+    check(js, "1e999 === 1/0", "true");
+    //最短的、能原样解析回来的输出
+    check(js, "0.1 + 0.2", "0.30000000000000004");
+    check(js, "1 / 3", "0.3333333333333333");
+    check(js, "123.456", "123.456");
+    check(js, "1e21", "1e+21");
+    check(js, "1e-7", "1e-7");
+    check(js, "0.000001", "0.000001");
+    check(js, "5e-324", "5e-324");
+    check(js, "1.7976931348623157e308", "1.7976931348623157e+308");
+    check(js, "let b=1e999; b.p=5", "ERROR: lookup in non-obj");
+    //最短的、能原样解析回来的输出
+    const char *json = "[0.30000000000000004,123.456,1e21,1e-7,0.000001,5e-324,"
+        "1.7976931348623157e308,1e999,-0.5,12345678901234567890]";
+    jsval_t v = js_json_parse(js, json, strlen(json));
+    js_json_stringify(js, v, out, sizeof(out));
+    if (strcmp(out, "[0.30000000000000004,123.456,1e+21,1e-7,0.000001,5e-324,"
+        "1.7976931348623157e+308,null,-0.5,12345678901234567000]") != 0) {
+        myloge("num fmt: %s", out);
+        nfail++;
+    }
+    js_json_stringify(js, js_mknum(1.0 / 3), out, sizeof(out));
+    if (strcmp(out, "0.3333333333333333") != 0) {
+        myloge("num fmt 1/3: %s", out);
+        nfail++;
+    }
+    //数字在记录的最后，不能读过界
+    char buf[3] = {'4', '2', '5'};
+    v = js_json_parse(js, buf, 2);
+    if (js_getnum(v) != 42) {
+        myloge("num parse past end: %g", js_getnum(v));
+        nfail++;
+    }
+}
+
+static void test_jit()
+{
+    struct js *js;
+    static char mem[16384];
+    char buf[1024];
+    js = js_create(mem, sizeof(mem));
+#if defined(__linux__) && defined(__x86_64__)
+    if (!js_jit(js, true)) {
+        myloge("js_jit failed");
+        nfail++;
+        return;
+    }
+#else
+    if (js_jit(js, true)) {
+        myloge("js_jit should be off on this platform");
+        nfail++;
+    }
+#endif
+    check(js, "let f = function(x, y) { let t = x * 2; return t > y ? t - y : -(y / t); }", "null");
+    check(js, "let pos = function(a) { return !(a <= 0) === true; }", "null");
+    check(js, "let k = 3", "null");
+    check(js, "let g = function(x) { return x * k; }", "null");//k是全局变量，不编译
+    for (int i = 0; i < 40; i++) {
+        check(js, "f(3, 4)", "2");
+        check(js, "pos(1)", "true");
+        check(js, "g(2)", "6");
+    }
+    capture(js_dump_jit, js, buf, sizeof(buf));
+#if defined(__linux__) && defined(__x86_64__)
+    if (strstr(buf, "compiled") == NULL || strstr(buf, "interpreted") == NULL) {
+        myloge("jit table: %s", buf);
+        nfail++;
+    }
+#endif
+    check(js, "f(1, 4)", "-2");
+    check(js, "f(-1.5, -4)", "1");
+    check(js, "f(0, 1) < -1e308", "true");
+    check(js, "typeof f(0, 0)", "\"number\"");//NaN要是规范的NaN
+    check(js, "pos(0)", "false");
+    check(js, "pos(0 / 0)", "true");
+    check(js, "f(\"a\", 1)", "ERROR: bad operands");//退回解释器
+    check(js, "f(3)", "ERROR: bad operands");
+    check(js, "f(3, 4, \"x\")", "2");
+    check(js, "k = 5; g(2)", "10");
+
+    //reset以后同一个位置的新函数不能用旧的机器码
+    js_mark(js);
+    check(js, "let h = function(x) { return x + 1; }", "null");
+    for (int i = 0; i < 40; i++) {
+        check(js, "h(2)", "3");
+    }
+    js_reset(js);
+    check(js, "let h = function(x) { return x * 100; }", "null");
+    for (int i = 0; i < 40; i++) {
+        check(js, "h(2)", "200");
+    }
+    check(js, "f(3, 4)", "2");
+
+    jsval_t args[2] = {js_mknum(5), js_mknum(4)};
+    jsval_t res = js_call(js, js_get(js, js_glob(js), "f"), args, 2);
+    if (js_getnum(res) != 6) {
+        myloge("js_call jit got %g", js_getnum(res));
+        nfail++;
+    }
+    js_jit(js, false);
+    check(js, "f(3, 4)", "2");
+    capture(js_dump_jit, js, buf, sizeof(buf));
+    if (buf[0] != '\0') {
+        myloge("jit table after off: %s", buf);
+        nfail++;
+    }
+}
+
+//只有一个site的时候，看它的类型、有没有quicken和计数
+static void sitewant(struct js *js, const char *kind, const char *state, unsigned hits, unsigned deopts)
+{
+    char out[256], k[16], s[16];
+    void *pc;
+    unsigned op, h, d;
+    capture(js_dump_sites, js, out, sizeof(out));
+    if (sscanf(out, "site %p op %u %15s %15s hits %u deopts %u", &pc, &op, k, s, &h, &d) != 6 ||
+        strcmp(k, kind) != 0 || strcmp(s, state) != 0 || h != hits || d != deopts) {
+        myloge("site: %s want %s %s hits %u deopts %u", out, kind, state, hits, deopts);
+        nfail++;
+    }
+}
+
+static void test_quicken()
+{
+    struct js *js;
+    static char mem[4096];
+    js = js_create(mem, sizeof(mem));
+    check(js, "let add = function(a, b) { return a + b; }", "null");
+    check(js, "add(1, 2)", "3");
+    sitewant(js, "num*num", "generic", 0, 0);
+    check(js, "add(1, 2)", "3");//连续QUICKEN_AFTER次以后quicken
+    sitewant(js, "num*num", "quickened", 0, 0);
+    for (int i = 0; i < 3; i++) {
+        check(js, "add(1.5, 2)", "3.5");
+    }
+    sitewant(js, "num*num", "quickened", 3, 0);
+    //num+num的site见到str+str，退回通用路径，结果不能错
+    check(js, "add(\"ab\", \"cd\")", "\"abcd\"");
+    sitewant(js, "str*str", "generic", 3, 1);
+    check(js, "add(\"ab\", \"cd\")", "\"abcd\"");
+    check(js, "add(\"x\", \"y\")", "\"xy\"");
+    sitewant(js, "str*str", "quickened", 4, 1);
+    check(js, "add(2, 2)", "4");
+    sitewant(js, "num*num", "generic", 4, 2);
+}
+
+static void test_numlib()
+{
+    struct js *js;
+    static char mem[4096];
+    static double nan5[5];
+    jsval_t v[5];
+    js = js_create(mem, sizeof(mem));
+    js_numlib(js);
+    //溢出和NaN写回数组以后还要是数字
+    jsval_t a = js_mkarr(js), z = js_mkarr(js);
+    v[0] = v[1] = js_mknum(1e308);
+    js_arr_push(js, a, v, 2);
+    for (int i = 0; i < 5; i++) {
+        v[i] = js_mknum(1);
+        nan5[i] = __builtin_nan("");//正的NaN
+    }
+    js_arr_push(js, z, v, 5);
+    js_set(js, js_glob(js), "a", a);
+    js_set(js, js_glob(js), "z", z);
+    js_set(js, js_glob(js), "h", js_mkbuffer_external(js, nan5, sizeof(nan5), JS_FLOAT64));
+    check(js, "num.prefixsum(a)", "[1e+308,null]");
+    check(js, "num.axpy(2,h,z)", "[null,null,null,null,null]");
+    for (int i = 0; i < 5; i++) {
+        if (js_isfunc(js_arr_get(js, z, i))) {
+            myloge("axpy result %d is boxed", i);
+            nfail++;
+        }
+    }
+    //SIMD和标量的实现结果要一样，11个元素可以走到向量循环后面剩下的部分
+    static double xd[11] = {3, -1, 4, 1, -5, 9, 2, 6, 5, 3, 5};
+    jsval_t x = js_mkarr(js), y = js_mkarr(js), e = js_mkarr(js);
+    for (int i = 0; i < 11; i++) {
+        jsval_t xv = js_mknum(xd[i]), yv = js_mknum(i + 1);
+        js_arr_push(js, x, &xv, 1);
+        js_arr_push(js, y, &yv, 1);
+    }
+    js_set(js, js_glob(js), "x", x);
+    js_set(js, js_glob(js), "y", y);
+    js_set(js, js_glob(js), "e", e);
+    js_set(js, js_glob(js), "xv", js_mkbuffer_external(js, xd, sizeof(xd), JS_FLOAT64));
+    for (int simd = 1; simd >= 0; simd--) {
+        bool on = js_numlib_simd(simd);
+#ifdef __x86_64__
+        if (on != simd) {
+            myloge("js_numlib_simd(%d) returned %d", simd, on);
+            nfail++;
+        }
+#endif
+        check(js, "num.sum(x)", "32");
+        check(js, "num.sum(xv)", "32");
+        check(js, "num.mean(x) === 32 / 11", "true");
+        check(js, "num.min(x)", "-5");
+        check(js, "num.max(xv)", "9");
+        check(js, "num.dot(x, y)", "238");
+        check(js, "num.dot(xv, y)", "238");
+        check(js, "num.histogram(x, -5, 10, 3)", "[2,5,4]");
+        check(js, "num.sum(e)", "0");
+        check(js, "num.min(e) > 1e308", "true");//+Infinity
+        check(js, "num.max(e) < -1e308", "true");//-Infinity
+        check(js, "typeof num.max(e)", "\"number\"");
+        check(js, "num.min(a)", "1e+308");
+        check(js, "num.max(h) === num.max(h)", "false");//NaN
+    }
+    js_numlib_simd(true);
+}
+
+static void test_free()
+{
+    struct js *js;
+    static char mem[4096];
+    size_t total, brk0, brk1, freeb0, freeb1, reused0, reused1;
+    js = js_create(mem, sizeof(mem));
+    //数组扩容以后旧的元素存储还回free list，后面有别的entity，不是brk最上面的块
+    jsval_t a = js_mkarr(js), o = js_mkobj(js);
+    for (int i = 0; i < 5; i++) {
+        jsval_t v = js_mknum(i);
+        js_arr_push(js, a, &v, 1);
+        js_set(js, o, "x", v);
+    }
+    js_stats(js, &total, &brk0, &freeb0, &reused0);
+    //同样大小的新存储从free list分配，brk只涨数组头的大小
+    jsval_t b = js_mkarr(js), v = js_mknum(1);
+    js_arr_push(js, b, &v, 1);
+    js_stats(js, &total, &brk1, &freeb1, &reused1);
+    if (freeb0 == 0 || freeb1 != 0 || reused1 != reused0 + 1 || brk1 - brk0 != 16) {
+        myloge("free list: brk %d -> %d, free %d -> %d, reused %d -> %d", (int)brk0, (int)brk1,
+            (int)freeb0, (int)freeb1, (int)reused0, (int)reused1);
+        nfail++;
+    }
+    //第一次调用以后scope还回free list，后面的调用从free list分配，brk不再涨
+    check(js, "let f = function(a, b) { let t = a; return t + b; }; f(1, 2)", "3");
+    js_stats(js, &total, &brk0, &freeb0, &reused0);
+    for (int i = 0; i < 10; i++) {
+        check(js, "f(1, 2)", "3");
+    }
+    js_stats(js, &total, &brk1, &freeb1, &reused1);
+    if (freeb0 == 0 || brk1 != brk0 || freeb1 != freeb0 || reused1 < reused0 + 10) {
+        myloge("free list: brk %d -> %d, free %d -> %d, reused %d -> %d", (int)brk0, (int)brk1,
+            (int)freeb0, (int)freeb1, (int)reused0, (int)reused1);
+        nfail++;
+    }
+    //每次调用留下一个新字符串，scope的块还是复用的，brk只涨字符串的大小
+    check(js, "let s = \"x\"; let g = function(a) { let u = a; s = \"yy\"; }; g(1); g(2)", "null");
+    js_stats(js, &total, &brk0, &freeb0, &reused0);
+    check(js, "g(3)", "null");
+    js_stats(js, &total, &brk1, &freeb1, &reused1);
+    if (brk1 - brk0 != 8 || reused1 <= reused0) {
+        myloge("free list with garbage: brk %d -> %d, reused %d -> %d", (int)brk0, (int)brk1,
+            (int)reused0, (int)reused1);
+        nfail++;
+    }
+}
+
+//解析json，返回用掉的arena字节数
+static size_t parsed(struct js *js, const char *json, jsval_t *v)
+{
+    size_t total, brk0, brk1, freeb, reused;
+    js_stats(js, &total, &brk0, &freeb, &reused);
+    *v = js_json_parse(js, json, strlen(json));
+    js_stats(js, &total, &brk1, &freeb, &reused);
+    return brk1 - brk0;
+}
+
+static void test_shape()
+{
+    struct js *js;
+    static char mem[8192];
+    char out[256];
+    jsval_t r1, r2, r3, r4, big;
+    js = js_create(mem, sizeof(mem));
+    //key和顺序一样的记录共用shape，只有第一条要分配shape
+    size_t n1 = parsed(js, "{\"id\":1,\"name\":\"a\",\"ok\":true}", &r1);
+    size_t n2 = parsed(js, "{\"id\":2,\"name\":\"b\",\"ok\":false}", &r2);
+    size_t n3 = parsed(js, "{\"id\":3,\"name\":\"c\",\"ok\":true}", &r3);
+    size_t n4 = parsed(js, "{\"name\":\"d\",\"id\":4,\"ok\":true}", &r4);
+    if (!(n1 > n2) || n3 != n2 || !(n4 > n2)) {
+        myloge("shape sharing: %d %d %d, reordered %d", (int)n1, (int)n2, (int)n3, (int)n4);
+        nfail++;
+    }
+    if (js_getnum(js_get(js, r2, "id")) != 2 || js_get(js, r2, "nope") != js_mkundef() ||
+        js_getnum(js_get(js, r4, "id")) != 4) {
+        myloge("js_get on slot object");
+        nfail++;
+    }
+    js_set(js, js_glob(js), "r3", r3);
+    check(js, "r3.name", "\"c\"");
+    check(js, "r3.id = 30; r3.extra = 1; r3", "{\"id\":30,\"name\":\"c\",\"ok\":true,\"extra\":1}");
+    //超过OBJ_INLINE个成员，后面的挂在prop链表上，顺序不变
+    const char *json = "{\"k0\":0,\"k1\":1,\"k2\":2,\"k3\":3,\"k4\":4,\"k5\":5,\"k6\":6,\"k7\":7,\"k8\":8,\"k9\":9}";
+    parsed(js, json, &big);
+    js_json_stringify(js, big, out, sizeof(out));
+    if (strcmp(out, json) != 0 || js_getnum(js_get(js, big, "k7")) != 7 ||
+        js_getnum(js_get(js, big, "k9")) != 9) {
+        myloge("overflow past inline slots: %s", out);
+        nfail++;
+    }
+    js_set(js, js_glob(js), "big", big);
+    check(js, "big.k9 = big.k0 + big.k8; big.k2 = 22; big.k9 + big.k2", "30");
+    //js_mkobj预留的slot放满以后也要能取到
+    jsval_t o = js_mkobj(js);
+    const char *keys[] = {"a", "b", "c", "d", "e", "f"};
+    for (int i = 0; i < 6; i++) {
+        js_set(js, o, keys[i], js_mknum(i));
+    }
+    for (int i = 0; i < 6; i++) {
+        if (js_getnum(js_get(js, o, keys[i])) != i) {
+            myloge("js_mkobj get %s", keys[i]);
+            nfail++;
+        }
+    }
+    /*
+        reset以后转换缓存里面mark之后的shape要去掉。mark之后建的{p}的shape所在的位置，
+        reset以后放一个看起来像shape的字符串（parent是0，第一个key是"p"，但是有两个key），
+        转换缓存还指着它的话，下一条{p,q}会用错shape，q放不进slot。
+    */
+    size_t total, brk0, brk1, freeb, reused;
+    uint32_t w[4];
+    js_mark(js);
+    js_stats(js, &total, &brk0, &freeb, &reused);
+    const uint8_t *arena = (const uint8_t *)mem + sizeof(mem) - total;
+    parsed(js, "{\"p\":1,\"q\":2}", &r1);
+    js_stats(js, &total, &brk1, &freeb, &reused);
+    size_t shape = 0;
+    for (size_t off = brk0; off + sizeof(w) <= brk1 && shape == 0; off += 4) {
+        memcpy(w, arena + off, sizeof(w));
+        shape = w[0] == ((12 << 2) | 3) && w[1] == 0 && w[2] == 1 ? off : 0;
+    }
+    js_reset(js);
+    static char fill[256];
+    memset(fill, 'z', sizeof(fill));
+    js_mkstr(js, "p", 1);//key在brk0
+    //字符串entity是4字节的头加上内容和结尾的0
+    if (shape < brk0 + 8 + 8 || js_iserr(js_mkstr(js, fill, shape - brk0 - 8 - 5))) {
+        myloge("shape {p} not found after mark");
+        nfail++;
+        return;
+    }
+    w[0] = 0;
+    w[1] = 2;
+    w[2] = w[3] = (uint32_t)brk0;
+    js_mkstr(js, w, sizeof(w));
+    parsed(js, "{\"p\":3,\"q\":4}", &r2);
+    js_json_stringify(js, r2, out, sizeof(out));
+    if (strcmp(out, "{\"p\":3,\"q\":4}") != 0 || js_getnum(js_get(js, r2, "q")) != 4) {
+        myloge("shape after reset: %s", out);
+        nfail++;
+    }
+}
+
+static void test_expr()
+{
+    struct js *js;
+    static char mem[4096];
+    js = js_create(mem, sizeof(mem));
+    //短路的一边出错以后，F_NOEXEC不能留下来
+    check(js, "1 || (2 + )", "ERROR: parse error");
+    check(js, "let zz=3; zz", "3");
+    check(js, "0 && (1 + )", "ERROR: parse error");
+    check(js, "1 ? 2 : (3 + )", "ERROR: parse error");
+    check(js, "zz + 1", "4");
+    //优先级
+    check(js, "1 + 2 * 3", "7");
+    check(js, "(1 + 2) * 3", "9");
+    check(js, "1 << 2 + 1", "8");
+    check(js, "5 & 3 | 8", "9");
+    check(js, "7 % 3 * 2", "2");
+    check(js, "1 + 2 < 4", "true");
+    check(js, "1 < 2 === true", "true");
+    //结合性：**和赋值从右往左，其他从左往右
+    check(js, "10 - 4 - 3", "3");
+    check(js, "100 / 10 / 5", "2");
+    check(js, "2 ** 3 ** 2", "512");
+    check(js, "let a=1, b=2; a = b = 7; a + b", "14");
+    check(js, "let q=10; q -= 2; q *= 3; q", "24");
+    //短路：不执行的一边没有副作用
+    check(js, "let c=0; 0 && (c = 1); c", "0");
+    check(js, "1 || (c = 2); c", "0");
+    check(js, "0 || (c = 3); c", "3");
+    check(js, "0 || 0 || 5", "5");
+    check(js, "1 && 2 && 3", "3");
+    //三元运算符，嵌套的时候从右往左
+    check(js, "false ? 1 : true ? 2 : 3", "2");
+    check(js, "1 ? 0 ? 4 : 5 : 6", "5");
+    check(js, "let d=0; 1 ? d = 1 : (d = 2); d", "1");
+    check(js, "let e=0; 0 ? (e = 1) : 2; e", "0");
+    check(js, "let i=1; i++ + ++i", "4");
+}
+
+static int ncalls;
+
+static jsval_t add1(struct js *js, jsval_t *args, int nargs)
+{
+    (void)js;
+    ncalls++;
+    return js_mknum(nargs > 0 ? js_getnum(args[0]) + 1 : 0);
+}
+
+static jsval_t fetch(struct js *js, jsval_t *args, int nargs)
+{
+    (void)args;
+    (void)nargs;
+    return js_mkpending(js);
+}
+
+static void test_suspend()
+{
+    struct js *js;
+    static char mem[4096];
+    const char *code = "let r = add1(2) + fetch(1); r + 1";
+    js = js_create(mem, sizeof(mem));
+    js_set(js, js_glob(js), "add1", js_mkfun(add1));
+    js_set(js, js_glob(js), "fetch", js_mkfun(fetch));
+    js_eval(js, code, strlen(code));
+    if (!js_suspended(js)) {
+        myloge("not suspended");
+        nfail++;
+    }
+    //重新执行语句的时候add1的结果从记录里面取，不会再调一次
+    jsval_t v = js_resume(js, js_mknum(5));
+    if (js_suspended(js) || js_getnum(v) != 9 || ncalls != 1) {
+        myloge("resume: %g, ncalls %d", js_getnum(v), ncalls);
+        nfail++;
+    }
+    check(js, "r", "8");
+    v = js_resume(js, js_mknum(5));
+    if (!js_iserr(v) || strcmp(js_errmsg(js), "ERROR: not suspended") != 0) {
+        myloge("resume without suspend: %s", js_errmsg(js));
+        nfail++;
+    }
+    //挂起之前的调用超过JS_MAXLOG次
+    check(js, "add1(1)+add1(1)+add1(1)+add1(1)+add1(1)+add1(1)+add1(1)+add1(1)+fetch(1)",
+        "ERROR: suspend log full");
+    if (js_suspended(js)) {
+        myloge("suspended after log overflow");
+        nfail++;
+    }
+    //函数里面不能挂起
+    check(js, "let g = function(x){ return fetch(x); }; g(1)", "ERROR: suspend in function");
+    check(js, "r", "8");
+    //重新执行会把挂起之前的js调用和赋值再做一遍，所以这种情况不能挂起
+    check(js, "let n = 0; let bump = function(){ n = n + 1; return n; }", "null");
+    check(js, "let r2 = bump() + fetch(1)", "ERROR: suspend after side effect");
+    check(js, "n = 10; let r3 = (n = n + 1) + fetch(1)", "ERROR: suspend after side effect");
+    if (js_suspended(js)) {
+        myloge("suspended after side effect");
+        nfail++;
+    }
+    check(js, "n", "11");
+    //副作用在挂起的调用后面就没问题，重新执行的时候只做一次
+    const char *after = "n = 0; let r4 = fetch(1) + bump(); r4";
+    js_eval(js, after, strlen(after));
+    v = js_resume(js, js_mknum(100));
+    if (js_suspended(js) || js_getnum(v) != 101) {
+        myloge("side effect after suspend: %g", js_getnum(v));
+        nfail++;
+    }
+    check(js, "n", "1");
+}
+
+static void test_batch()
+{
+    struct js *js;
+    static char mem[4096];
+    const char *recs[] = {"{\"a\":1,\"s\":\"x\"}", "{\"a\":2,\"s\":\"yy\"}", "{\"s\":\"zzz\"}"};
+    jsval_t out[3];
+    char buf[100];
+    size_t total, brk0, brk1, freeb, reused, len;
+    js = js_create(mem, sizeof(mem));
+    check(js, "let k = 10", "null");
+    //每条记录绑定到rec，数字结果不占内存，arena退回到开始的地方
+    js_batch(js, "rec", "rec.a * k", ~0U, recs, NULL, 2, out);
+    js_stats(js, &total, &brk0, &freeb, &reused);
+    size_t nerr = js_batch(js, "rec", "rec.a * k", ~0U, recs, NULL, 3, out);
+    js_stats(js, &total, &brk1, &freeb, &reused);
+    //第三条没有a，出错只算这一条
+    if (nerr != 1 || js_getnum(out[0]) != 10 || js_getnum(out[1]) != 20 || !js_iserr(out[2]) ||
+        brk1 != brk0) {
+        myloge("batch num: nerr %d, %g %g, brk %d -> %d", (int)nerr,
+            js_getnum(out[0]), js_getnum(out[1]), (int)brk0, (int)brk1);
+        nfail++;
+    }
+    //字符串结果挪到mark的位置留下来，只多用了字符串的大小
+    js_stats(js, &total, &brk0, &freeb, &reused);
+    nerr = js_batch(js, "rec", "rec.s", ~0U, recs, NULL, 3, out);
+    js_stats(js, &total, &brk1, &freeb, &reused);
+    for (int i = 0; i < 3; i++) {
+        const char *str = js_getstr(js, out[i], &len);
+        if (str == NULL || len != (size_t)i + 1 || str[0] != "xyz"[i]) {
+            myloge("batch keep string %d", i);
+            nfail++;
+        }
+    }
+    if (nerr != 0 || brk1 - brk0 > 3 * 8) {
+        myloge("batch keep string: brk %d -> %d", (int)brk0, (int)brk1);
+        nfail++;
+    }
+    //对象结果整条记录都留下来
+    nerr = js_batch(js, "rec", "rec", ~0U, recs, NULL, 2, out);
+    js_json_stringify(js, out[1], buf, sizeof(buf));
+    if (nerr != 0 || strcmp(buf, recs[1]) != 0) {
+        myloge("batch keep object: %s", buf);
+        nfail++;
+    }
+    check(js, "rec", "null");
+    //rule改了批处理之前的变量和对象，每条记录结束以后撤销，不会指到回收了的内存
+    js = js_create(mem, sizeof(mem));
+    check(js, "let last = 0", "null");
+    js_set(js, js_glob(js), "o", js_json_parse(js, "{\"n\":1}", 7));
+    js_batch(js, "rec", "last = rec.s; o.n = rec.a; 1", ~0U, recs, NULL, 2, out);
+    js_stats(js, &total, &brk0, &freeb, &reused);
+    nerr = js_batch(js, "rec", "last = rec.s; o.n = rec.a; 1", ~0U, recs, NULL, 2, out);
+    js_stats(js, &total, &brk1, &freeb, &reused);
+    if (nerr != 0 || js_getnum(out[1]) != 1 || brk1 != brk0) {
+        myloge("batch undo: nerr %d, brk %d -> %d", (int)nerr, (int)brk0, (int)brk1);
+        nfail++;
+    }
+    check(js, "let z = \"QQQQQQQQQQQQQQQQQQQQ\" + \"ZZZZZZZZZZZZZZZZZZZZ\"; last", "0");
+    check(js, "o.n", "1");
+}
+
+//js_alloc失败的时候会打印oom，用capture收起来
+static void mkhuge(struct js *js)
+{
+    js_mkstr(js, NULL, 1U << 20);
+}
+
+static void test_heap()
+{
+    struct js *js;
+    static char mem[8192];
+    static char out[4096];
+    const char *json = "{\"name\":\"a fairly long string value\",\"n\":1}";
+    const char *code = "let s = \"hello\"; let f = function(a, b) { let t = a; }; f(1, 2); f(3, 4);";
+    unsigned n, bytes, n2, bytes2;
+    const char *p;
+    js = js_create(mem, sizeof(mem));
+    js_profile_allocs(js, true);
+    js_set(js, js_glob(js), "rec", js_json_parse(js, json, strlen(json)));
+    js_eval(js, code, strlen(code));
+    capture(js_dump_heap, js, out, sizeof(out));
+    //函数调用的scope还回去以后是死的entity
+    p = strstr(out, "  dead ");
+    if (p == NULL || sscanf(p, "  dead %u entities %u bytes", &n, &bytes) != 2 || n == 0 || bytes == 0) {
+        myloge("heap census: no dead entities\n%s", out);
+        nfail++;
+    }
+    //死的块按原来的类型分开：scope对象、参数的prop、参数名的字符串
+    const char *dead[] = {"object", "prop", "string"};
+    unsigned dn = 0, dbytes = 0;
+    for (int i = 0; i < 3; i++) {
+        char name[20];
+        snprintf(name, sizeof(name), "    dead %-6s", dead[i]);
+        p = strstr(out, name);
+        if (p == NULL || sscanf(p + strlen(name), "%u entities %u bytes", &n2, &bytes2) != 2 || n2 == 0) {
+            myloge("heap census: no dead %s\n%s", dead[i], out);
+            nfail++;
+            continue;
+        }
+        dn += n2;
+        dbytes += bytes2;
+    }
+    if (dn != n || dbytes != bytes) {
+        myloge("heap census: dead by type %u/%u, total %u/%u", dn, dbytes, n, bytes);
+        nfail++;
+    }
+    if (strstr(out, "len 26 \"a fairly long st\"") == NULL || strstr(out, "object @0 ") == NULL) {
+        myloge("heap census: largest entities missing\n%s", out);
+        nfail++;
+    }
+    //宿主直接调用API的分配单独统计，不能算到上次执行的脚本位置上
+    p = strstr(out, "alloc site host");
+    if (p == NULL || sscanf(p, "alloc site host allocs %u bytes %u", &n, &bytes) != 2 ||
+        strstr(out, "toff ") == NULL) {
+        myloge("alloc sites missing\n%s", out);
+        nfail++;
+        return;
+    }
+    //分配失败的不统计
+    capture(mkhuge, js, out, sizeof(out));
+    capture(js_dump_allocs, js, out, sizeof(out));
+    p = strstr(out, "alloc site host");
+    if (p == NULL || sscanf(p, "alloc site host allocs %u bytes %u", &n2, &bytes2) != 2 ||
+        n2 != n || bytes2 != bytes) {
+        myloge("failed alloc counted\n%s", out);
+        nfail++;
+    }
+}
+
+/*
+    装载缓存的时候site表的计数会清零，js_dump_sites什么都不输出；
+    真正执行过的话会有site。用这个区分有没有命中。
+*/
+static bool cachehit(const char *dir, const char *code, const char *want)
+{
+    static char mem[4096];
+    char out[512];
+    struct js *js = js_create(mem, sizeof(mem));
+    jsval_t v = js_eval_cached(js, dir, code, strlen(code));
+    if (js_iserr(v) || js_json_stringify(js, v, out, sizeof(out)) == 0 || strcmp(out, want) != 0) {
+        myloge("cached eval: got %s, want %s", js_iserr(v) ? js_errmsg(js) : out, want);
+        nfail++;
+    }
+    capture(js_dump_sites, js, out, sizeof(out));
+    check(js, "f(2)", "12");
+    return out[0] == '\0';
+}
+
+static void test_cache()
+{
+    char dir[] = "/tmp/elkcXXXXXX", path[300];
+    const char *code = "let k = 2 * 3; let f = function(x) { return x * k; }; k + 1";
+    struct dirent *de;
+    FILE *f;
+    if (mkdtemp(dir) == NULL) {
+        myloge("mkdtemp fail");
+        nfail++;
+        return;
+    }
+    if (cachehit(dir, code, "7")) {
+        myloge("cache hit in empty dir");
+        nfail++;
+    }
+    DIR *d = opendir(dir);
+    path[0] = '\0';
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        if (strstr(de->d_name, ".elkc") != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    if (path[0] == '\0' || !cachehit(dir, code, "7")) {
+        myloge("cache not used: %s", path);
+        nfail++;
+    }
+    //arena的内容坏了，checksum对不上，重新执行并且重写缓存
+    f = fopen(path, "r+b");
+    fseek(f, -8, SEEK_END);
+    fputc(0x5a, f);
+    fclose(f);
+    if (cachehit(dir, code, "7") || !cachehit(dir, code, "7")) {
+        myloge("corrupt cache not replaced");
+        nfail++;
+    }
+    //文件被截断
+    if (truncate(path, 40) != 0 || cachehit(dir, code, "7")) {
+        myloge("truncated cache used");
+        nfail++;
+    }
+    //头部不对，比如旧版本的格式
+    f = fopen(path, "r+b");
+    fputc('X', f);
+    fclose(f);
+    if (cachehit(dir, code, "7")) {
+        myloge("stale cache used");
+        nfail++;
+    }
+    //代码变了，key不一样
+    if (cachehit(dir, "let k = 2 * 3; let f = function(x) { return x * k; }; k + 2", "8")) {
+        myloge("cache hit for other code");
+        nfail++;
+    }
+    d = opendir(dir);
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void test_reset()
+{
+    struct js *js;
+    static char mem[4096];
+    size_t total, brk0, brk1, brk2, freeb, reused;
+    js = js_create(mem, sizeof(mem));
+    uint8_t *arena = (uint8_t *)mem + sizeof(mem);
+    check(js, "let x = 1", "null");
+    js_mark(js);
+    js_stats(js, &total, &brk0, &freeb, &reused);
+    arena -= total;//js->mem在struct js后面，到buffer的最后
+    check(js, "let y = \"some string that takes space\"; let z = y", "null");
+    //调用的参数放在arena最顶上，reset的时候也要清掉
+    check(js, "let f = function(a, b) { return a; }; f(12345, 6)", "12345");
+    if (arena[total - 1] == 0 && arena[total - 9] == 0) {
+        myloge("call args not at the top of the arena");
+        nfail++;
+    }
+    js_stats(js, &total, &brk1, &freeb, &reused);
+    arena[brk1 + 64] = 0xaa;//高水位以上的内存reset不会去碰
+    js_reset(js);
+    js_stats(js, &total, &brk2, &freeb, &reused);
+    if (brk2 != brk0) {
+        myloge("reset brk %d, want %d", (int)brk2, (int)brk0);
+        nfail++;
+    }
+    for (size_t i = brk0; i < brk1; i++) {
+        if (arena[i] != 0) {
+            myloge("reset left data at %d", (int)i);
+            nfail++;
+            break;
+        }
+    }
+    if (arena[brk1 + 64] != 0xaa) {
+        myloge("reset cleared above the high-water mark");
+        nfail++;
+    }
+    for (size_t i = total - 16; i < total; i++) {
+        if (arena[i] != 0) {
+            myloge("reset left call args at %d", (int)i);
+            nfail++;
+            break;
+        }
+    }
+    check(js, "x", "1");
+    check(js, "y", "ERROR: 'y' not found");
+}
+
+static void pool_init(struct js *js)
+{
+    js_set(js, js_glob(js), "base", js_mknum(42));
+    js_eval(js, "let cfg = 1", 11);
+}
+
+static void test_pool()
+{
+    static char buf[16384], other[1024];
+    struct js *all[16];
+    size_t n = 0;
+    struct jspool *pool = js_pool_create(buf, sizeof(buf), 2048, pool_init);
+    if (pool == NULL) {
+        myloge("js_pool_create fail");
+        nfail++;
+        return;
+    }
+    struct js *a = js_pool_acquire(pool);
+    check(a, "let t = base + 1; t", "43");
+    if (!js_pool_release(pool, a)) {
+        myloge("release fail");
+        nfail++;
+    }
+    //还回去的时候退回到init以后的状态
+    struct js *b = js_pool_acquire(pool);
+    if (b != a) {
+        myloge("pool is not lifo");
+        nfail++;
+    }
+    check(b, "t", "ERROR: 't' not found");
+    check(b, "base", "42");
+    //改了init里面的全局变量，还回去的时候恢复，不能指到退掉的字符串
+    check(b, "cfg = \"abc\" + \"defghijklmnopqrstuvwxyz\"; cfg", "\"abcdefghijklmnopqrstuvwxyz\"");
+    js_pool_release(pool, b);
+    b = js_pool_acquire(pool);
+    check(b, "let z = \"QQQQQQQQQQQQQQQQQQQQ\" + \"ZZZZZZZZZZZZZZZZZZZZ\"; cfg", "1");
+    //反复改同一个变量，undo log只记一次
+    for (int i = 0; i < 300; i++) {
+        js_eval(b, "cfg = cfg + 1", 13);
+    }
+    check(b, "cfg", "301");
+    js_pool_release(pool, b);
+    b = js_pool_acquire(pool);
+    check(b, "cfg", "1");
+    js_pool_release(pool, b);
+    //重复还、还别的实例都要报错，不能让一个实例被借出去两次
+    if (js_pool_release(pool, b) || js_pool_release(pool, js_create(other, sizeof(other))) ||
+        js_pool_release(pool, (struct js *)(buf + 1000)) || js_pool_release(pool, NULL)) {
+        myloge("bad release accepted");
+        nfail++;
+    }
+    while (n < 16 && (all[n] = js_pool_acquire(pool)) != NULL) {
+        n++;
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            if (all[i] == all[j]) {
+                myloge("instance handed out twice");
+                nfail++;
+            }
+        }
+        js_pool_release(pool, all[i]);
+    }
+    if (n < 2 || n >= 16) {
+        myloge("pool size %d", (int)n);
+        nfail++;
+    }
+}
+
+#ifdef __linux__
+static void test_loop()
+{
+    static char mem1[4096], mem2[4096];
+    int fds[2];
+    struct jsloop *loop = js_loop_create();
+    struct js *js = js_create(mem1, sizeof(mem1)), *js2 = js_create(mem2, sizeof(mem2));
+    js_loop_add(loop, js);
+    js_loop_add(loop, js2);
+    //按到期时间执行，和加进来的顺序无关；两个js共用一个loop
+    check(js, "let t = 0; setTimeout(function(){ t = t * 10 + 3; }, 30);"
+        "setTimeout(function(){ t = t * 10 + 1; }, 10); 0", "0");
+    check(js2, "let u = 0; setTimeout(function(){ u = 2; }, 20); 0", "0");
+    //microtask在当前回调结束以后、下一个定时器之前执行，执行中新加的也在同一批
+    check(js, "let m = 0; setTimeout(function(){ m = 1; setTimeout(function(){ m = m * 10 + 4; }, 0);"
+        "queueMicrotask(function(){ m = m * 10 + 2; queueMicrotask(function(){ m = m * 10 + 3; }); });"
+        "}, 1); 0", "0");
+    check(js, "let n = 0; let id = setInterval(function(){ n++; n === 3 ? clearInterval(id) : 0; }, 1); 0", "0");
+    check(js, "let c = 0; let cid = setTimeout(function(){ c = 1; }, 5); clearTimeout(cid); 0", "0");
+    //fd可读的时候回调，参数是fd
+    if (pipe(fds) != 0 || write(fds[1], "x", 1) != 1) {
+        myloge("pipe fail");
+        nfail++;
+        return;
+    }
+    js_set(js, js_glob(js), "rfd", js_mknum(fds[0]));
+    check(js, "let got = -1; watch(rfd, function(fd){ got = fd; unwatch(fd); }); 0", "0");
+    js_loop_run(loop);
+    check(js, "t", "13");
+    check(js2, "u", "2");
+    check(js, "m", "1234");
+    check(js, "n", "3");
+    check(js, "c", "0");
+    check(js, "got === rfd", "true");
+    js_loop_remove(loop, js);
+    js_loop_remove(loop, js2);
+    js_loop_destroy(loop);
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
+int main(void)
 {
     test_basic();
-    return 0;
+    test_json();
+    test_arr();
+    test_view();
+    test_xstr();
+    test_call();
+    test_num();
+    test_jit();
+    test_quicken();
+    test_numlib();
+    test_free();
+    test_shape();
+    test_expr();
+    test_suspend();
+    test_batch();
+    test_heap();
+    test_cache();
+    test_reset();
+    test_pool();
+#ifdef __linux__
+    test_loop();
+#endif
+    return nfail != 0;
 }